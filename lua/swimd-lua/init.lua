@@ -1,16 +1,47 @@
 local M = {}
 
 M.timer = nil
+M.notify_handle = nil
+M.notify_listeners = {}
+M.ffi = nil -- LuaJIT FFI bindings of the library, see M.load_ffi
+M.rows_chunk = 32 -- rows printed at once when the picker looks at one
 
-M.setup = function()
+M.setup = function(opts)
+    opts = opts or {}
     M.setup_libs()
     M.load_libs()
 
     local swimd = require("swimd")
+    M.load_ffi()
     swimd.init(M.log_path())
+    if opts.prune then
+        swimd.set_prune_list(opts.prune)
+    end
+    if opts.watch then
+        swimd.set_watch(true)
+    end
+    if opts.index ~= false then
+        swimd.set_index_dir(M.index_dir())
+    end
 
     local cwd = vim.fn.getcwd()
     swimd.setup_workspace(cwd)
+    vim.api.nvim_create_autocmd('VimLeavePre', {
+        once = true,
+        callback = M.shutdown,
+    })
+end
+
+-- The notify poll is closed before swimd.shutdown closes the fd under it.
+M.shutdown = function ()
+    M.stop_refresh_timer()
+    M.notify_listeners = {}
+    if M.notify_handle then
+        M.notify_handle:stop()
+        M.notify_handle:close()
+        M.notify_handle = nil
+    end
+    require("swimd").shutdown()
 end
 
 M.setup_libs = function ()
@@ -53,6 +84,113 @@ M.log_path = function ()
     return result
 end
 
+M.index_dir = function ()
+    local result = vim.fn.stdpath('cache') .. '/swimd'
+    vim.fn.mkdir(result, 'p')
+    return result
+end
+
+-- Results come back as flat C arrays instead of a table per item. Stays nil
+-- without LuaJIT, the Lua C API is used then.
+M.load_ffi = function ()
+    if M.ffi then
+        return
+    end
+    local has_ffi, ffi = pcall(require, "ffi")
+    if not has_ffi then
+        return
+    end
+    local loaded, lib = pcall(function ()
+        ffi.cdef[[
+            typedef struct {
+                int score;
+                int path_offset;
+                int name_offset;
+            } SwimdFfiItem;
+
+            typedef struct {
+                int scan_in_progress;
+                int scanned_items_count;
+                int items_length;
+                int paths_size;
+                SwimdFfiItem *items;
+                char *paths;
+            } SwimdFfiResult;
+
+            int swimd_query_ffi(const char *needle, int max_size, int scanner_index, SwimdFfiResult *out);
+            int swimd_rows_ffi(const void *handle, int first, int count, SwimdFfiResult *out);
+        ]]
+        return ffi.load((M.lib_path():gsub('%?', 'swimd')))
+    end)
+    if not loaded then
+        M.log("FFI unavailable, " .. tostring(lib))
+        return
+    end
+    M.ffi = { ffi = ffi, lib = lib }
+end
+
+-- One result buffer per source, reused by every query of it.
+M.create_ffi_result = function (max_size)
+    local ffi = M.ffi.ffi
+    local swimd = require("swimd")
+    local buffer = {
+        result = ffi.new("SwimdFfiResult"),
+        items = ffi.new("SwimdFfiItem[?]", max_size),
+        paths = ffi.new("char[?]", max_size * swimd.MAX_PATH_LENGTH),
+    }
+    buffer.result.items = buffer.items
+    buffer.result.paths = buffer.paths
+    buffer.result.paths_size = max_size * swimd.MAX_PATH_LENGTH
+    return buffer
+end
+
+-- Rows first to last of a poll_query handle through the buffer, nil when
+-- the snapshot changed since the query.
+M.ffi_rows = function (buffer, hits, first, last)
+    local ffi = M.ffi.ffi
+    local length = M.ffi.lib.swimd_rows_ffi(hits, first - 1, last - first + 1, buffer.result)
+    if length < 0 then
+        return nil
+    end
+    local rows = {}
+    for i = 0, length - 1 do
+        local item = buffer.items[i]
+        rows[i + 1] = {
+            score = item.score,
+            name = ffi.string(buffer.paths + item.name_offset),
+            path = ffi.string(buffer.paths + item.path_offset),
+        }
+    end
+    return rows
+end
+
+-- Picker data over a poll_query handle. Rows are printed a chunk at a time
+-- when the picker first looks at them, a missing row means the snapshot
+-- changed since the query and it has to be submitted again.
+M.hits_data = function (hits, fetch_rows)
+    local count = hits:count()
+    local items = setmetatable({}, { __index = function (items, i)
+        if type(i) ~= "number" or i < 1 or i > count then
+            return nil
+        end
+        local first = i - (i - 1) % M.rows_chunk
+        local rows = fetch_rows(hits, first, math.min(first + M.rows_chunk - 1, count))
+        if not rows then
+            return nil
+        end
+        for k, row in ipairs(rows) do
+            rawset(items, first + k - 1, row)
+        end
+        return rawget(items, i)
+    end })
+    return {
+        scan_in_progress = hits:scan_in_progress(),
+        scanned_items_count = hits:scanned_items_count(),
+        items = items,
+        count = count,
+    }
+end
+
 M.load_libs = function ()
     local swimd_path = M.lib_path()
     local swimd_depenecies = M.dependent_libs()
@@ -94,11 +232,51 @@ M.plugin_dir = function ()
     return plugin_dir .. '/'
 end
 
+-- Calls listener(events) on the main loop with a mask of swimd.NOTIFY_QUERY
+-- and swimd.NOTIFY_SCAN, a nil listener removes the one under that name.
+-- Returns false when the library has no notify fd and the caller has to poll.
+M.listen = function (name, listener)
+    M.notify_listeners[name] = listener
+    if M.notify_handle then
+        return true
+    end
+    local swimd = require("swimd")
+    local fd = swimd.notify_fd()
+    if not fd then
+        return false
+    end
+    M.notify_handle = vim.loop.new_poll(fd)
+    M.notify_handle:start('r', function ()
+        -- drained right away, the poll is level triggered
+        local events = swimd.notify_drain()
+        vim.schedule(function ()
+            for _, notify_listener in pairs(M.notify_listeners) do
+                notify_listener(events)
+            end
+        end)
+    end)
+    return true
+end
+
 M.refresh = function ()
     local swimd = require("swimd")
     swimd.refresh_workspace()
     M.log("refreshing...")
-    M.start_refresh_timer()
+    if not M.listen("refresh", M.on_refresh_notify) then
+        M.start_refresh_timer()
+    end
+end
+
+M.on_refresh_notify = function (events)
+    local swimd = require("swimd")
+    if bit.band(events, swimd.NOTIFY_SCAN) == 0 then
+        return
+    end
+    local res = swimd.is_refreshing()
+    if not res.refreshing then
+        M.log("refresh completed " .. M.refresh_details(res))
+        M.listen("refresh", nil)
+    end
 end
 
 M.start_refresh_timer = function ()
@@ -109,10 +287,7 @@ M.start_refresh_timer = function ()
     M.timer:start(0, 300, vim.schedule_wrap(function()
         local swimd = require("swimd")
         local res = swimd.is_refreshing()
-
-        local git_details = M.print_details("git", res.details[swimd.SCANNER_GIT + 1])
-        local files_details = M.print_details("files", res.details[swimd.SCANNER_FILES + 1])
-        local details = "[" .. git_details .. ", " .. files_details .. "]"
+        local details = M.refresh_details(res)
 
         if res.refreshing then
             M.log("refreshing " .. details)
@@ -123,6 +298,13 @@ M.start_refresh_timer = function ()
     end))
 end
 
+M.refresh_details = function (res)
+    local swimd = require("swimd")
+    local git_details = M.print_details("git", res.details[swimd.SCANNER_GIT + 1])
+    local files_details = M.print_details("files", res.details[swimd.SCANNER_FILES + 1])
+    return "[" .. git_details .. ", " .. files_details .. "]"
+end
+
 M.print_details = function (scanner_name, status_details)
     local res = ""
     res = res .. scanner_name .. ": "
@@ -147,13 +329,13 @@ end
 M.open_picker_files = function ()
     local swimd = require("swimd")
     local picker = require("swimd-lua/picker")
-    picker.open("files", M.create_data_callback(swimd.SCANNER_FILES))
+    picker.open("files", M.create_query_source(swimd.SCANNER_FILES))
 end
 
 M.open_picker_git = function ()
     local swimd = require("swimd")
     local picker = require("swimd-lua/picker")
-    picker.open("git", M.create_data_callback(swimd.SCANNER_GIT))
+    picker.open("git", M.create_query_source(swimd.SCANNER_GIT))
 end
 
 M.is_linux = function ()
@@ -161,13 +343,34 @@ M.is_linux = function ()
     return os_name == "Linux"
 end
 
-M.create_data_callback = function(scanner)
-    return function (input)
-        local swimd = require("swimd")
-        local res = swimd.process_input(input, 100, scanner)
-
-        return res
+M.create_query_source = function(scanner)
+    local swimd = require("swimd")
+    local fetch_rows = function (hits, first, last)
+        return hits:rows(first, last)
+    end
+    if M.ffi then
+        local buffer = M.create_ffi_result(M.rows_chunk)
+        fetch_rows = function (hits, first, last)
+            return M.ffi_rows(buffer, hits, first, last)
+        end
     end
+    return {
+        submit = function (input)
+            return swimd.submit_query(input, 100, scanner)
+        end,
+        poll = function (id)
+            local hits = swimd.poll_query(id)
+            if not hits then
+                return hits
+            end
+            return M.hits_data(hits, fetch_rows)
+        end,
+        listen = function (listener)
+            return M.listen("picker", listener)
+        end,
+        NOTIFY_QUERY = swimd.NOTIFY_QUERY,
+        NOTIFY_SCAN = swimd.NOTIFY_SCAN,
+    }
 end
 
 M.file_exists = function (path)
@@ -1,6 +1,8 @@
 local M = {}
 
+M.data = nil
 M.matches = {}
+M.matches_count = 0
 M.input = ""
 M.selected = 1
 
@@ -14,12 +16,23 @@ M.input_buf = nil
 M.list_buf = nil
 M.input_win = nil
 M.list_win = nil
-M.data_callback = nil
+M.source = nil
 
+M.query_id = nil
+M.query_reset_selection = false
+M.notified = false
+M.poll_timer = nil
 M.timer = nil
 
-M.open = function(title, data_callback)
-    M.data_callback = data_callback
+-- source.submit(input) starts a query and returns its id, source.poll(id)
+-- returns the results with their count once it is done, nil while it runs and false when a
+-- newer query replaced it. source.listen(listener) subscribes to scan and
+-- query events and returns false when they are not available, then the
+-- picker polls with timers.
+M.open = function(title, source)
+    M.source = source
+    M.data = nil
+    M.notified = source.listen(M.on_notify)
 
     local frame_cols = vim.o.columns
     local frame_rows = vim.o.lines
@@ -120,25 +133,100 @@ M.update_display_window = function ()
     M.display_selected = M.selected - M.display_window_ind + 1
 end
 
+-- Scoring runs on a background thread, only the latest query is rendered.
 M.update = function (reset_selection)
-    local data = M.data_callback(M.input)
+    M.query_id = M.source.submit(M.input)
+    M.query_reset_selection = M.query_reset_selection or reset_selection
+    if not M.notified then
+        M.start_poll_timer()
+    end
+end
+
+-- Returns false while the query still runs.
+M.poll = function ()
+    local data = M.source.poll(M.query_id)
+    if data == nil then
+        return false
+    end
+    if data and vim.api.nvim_win_is_valid(M.input_win) then
+        M.data = data
+        local reset_selection = M.query_reset_selection
+        M.query_reset_selection = false
+        M.render(reset_selection)
+    end
+    return true
+end
+
+M.on_notify = function (events)
+    if not vim.api.nvim_win_is_valid(M.input_win) then
+        return
+    end
+    if bit.band(events, M.source.NOTIFY_QUERY) ~= 0 then
+        M.poll()
+    end
+    -- results shown while scanning are outdated, a query in flight may have
+    -- started before the scan finished so it is replaced as well
+    if bit.band(events, M.source.NOTIFY_SCAN) ~= 0 and (not M.data or M.data.scan_in_progress) then
+        M.update(false)
+    end
+end
+
+M.start_poll_timer = function ()
+    if M.poll_timer then
+        return
+    end
+    M.poll_timer = vim.loop.new_timer()
+    M.poll_timer:start(0, 5, vim.schedule_wrap(function()
+        if not M.poll_timer then -- stopped while scheduled
+            return
+        end
+        -- a render that finds the files changed submits the query again
+        local query_id = M.query_id
+        if M.poll() and M.query_id == query_id then
+            M.stop_poll_timer()
+        end
+    end))
+end
+
+M.stop_poll_timer = function ()
+    if M.poll_timer then
+        M.poll_timer:stop()
+        M.poll_timer:close()
+        M.poll_timer = nil
+    end
+end
+
+M.render = function (reset_selection)
+    local data = M.data
+    if not data then
+        return
+    end
     M.matches = data.items
-    if #M.matches == 0 then
+    M.matches_count = data.count
+    if M.matches_count == 0 then
         M.selected = 0
-    elseif reset_selection then
+    elseif reset_selection or M.selected == 0 then
         M.selected = 1
+    elseif M.selected > M.matches_count then
+        M.selected = M.matches_count
     end
 
     M.update_display_window()
     local lines = {}
     local lines_start = M.display_window_ind
     local lines_end = math.min(M.display_window_ind + M.display_window_size - 1,
-        #M.matches)
+        M.matches_count)
 
     for i = lines_start, lines_end do
-        table.insert(lines, M.matches[i])
+        local match = M.matches[i]
+        if not match then
+            -- the files changed since the query
+            M.update(false)
+            return
+        end
+        table.insert(lines, match)
     end
-    if #M.matches == 0 then
+    if M.matches_count == 0 then
         if data.scan_in_progress then
             local scanning = "Scanning " .. data.scanned_items_count .. " ..."
             table.insert(lines, { name = scanning, path = "", is_loading = true })
@@ -157,7 +245,7 @@ M.update = function (reset_selection)
         })
     end
 
-    if data.scan_in_progress then
+    if data.scan_in_progress and not M.notified then
         M.start_refresh_timer()
     else
         M.stop_refresh_timer()
@@ -174,7 +262,8 @@ M.start_refresh_timer = function ()
             M.stop_refresh_timer()
             return
         end
-        M.update(true)
+        -- results grow while scanning, keep the selection
+        M.update(false)
     end))
 end
 
@@ -187,6 +276,11 @@ M.stop_refresh_timer = function ()
 end
 
 M.close_all = function ()
+    M.stop_poll_timer()
+    if M.notified then
+        M.source.listen(nil)
+        M.notified = false
+    end
     if vim.api.nvim_win_is_valid(M.input_win) then
         vim.api.nvim_win_close(M.input_win, true)
     end
@@ -226,15 +320,15 @@ M.handle_events = function ()
             vim.api.nvim_buf_set_keymap(M.input_buf, 'i', '<C-n>', '', {
                 noremap = false,
                 callback = function()
-                    M.selected = M.selected < #M.matches and M.selected + 1 or 1
-                    M.update(false)
+                    M.selected = M.selected < M.matches_count and M.selected + 1 or 1
+                    M.render(false)
                 end
             })
             vim.api.nvim_buf_set_keymap(M.input_buf, 'i', '<C-p>', '', {
                 noremap = false,
                 callback = function()
-                    M.selected = M.selected > 1 and M.selected - 1 or #M.matches
-                    M.update(false)
+                    M.selected = M.selected > 1 and M.selected - 1 or M.matches_count
+                    M.render(false)
                 end
             })
         end
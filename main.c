@@ -3,12 +3,26 @@
 #else
     #include <pthread.h>
     #include <dirent.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/resource.h>
+    #include <sys/syscall.h>
+    #include <sys/inotify.h>
+    #include <sys/eventfd.h>
+    #include <errno.h>
 #endif
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <assert.h>
 #include <immintrin.h>
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
 #include <stdio.h>
 #include <stdarg.h>
 #include <limits.h>
@@ -40,7 +54,28 @@
 #endif
 
 #define MAX_PATH_LENGTH 300
-#define LANES_COUNT_SHORT 16
+#define MAX_LANES_COUNT 32
+#define MAX_SCORE_WORKERS 64
+#define SCORE_CHUNK_BLOCKS 64
+#define ROWS_CACHE_DEPTH 4
+#define MAX_WALK_WORKERS 32
+#define WALK_DENTS_BUFFER_SIZE (64 * 1024)
+#define WALK_STREAM_CHUNK 2048
+#define WALK_STREAM_INTERVAL_MS 50
+#define WALK_MAX_OPEN_DIRS 256
+#define WATCH_EVENTS_BUFFER_SIZE (64 * 1024)
+#define NOTIFY_PROGRESS_FILES 8192
+#define SWIMD_NOTIFY_QUERY 1 // an asynchronous query is done
+#define SWIMD_NOTIFY_SCAN 2 // a scan finished or its partial snapshot grew
+#define SWIMD_HITS_METATABLE "swimd.hits"
+#define GIT_INDEX_HEADER_SIZE 12
+#define GIT_INDEX_ENTRY_FIXED_SIZE 62 // stat data, sha1 and flags
+#define GIT_INDEX_ENTRY_EXTENDED 0x4000
+#define GIT_INDEX_PATH_BUFFER_SIZE 4096
+#define SWIMD_BYTE_LEVELS_MAX 13
+#define SWIMD_ALIGNMENT 64
+#define SWIMD_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define SWIMD_INDEX_VERSION 1
 #define ERROR_THRESHOLD 0.2
 #define LEN_DIFF_ERROR_COST 0.3
 #define SUB_PENALTY -9
@@ -51,9 +86,14 @@ static int GAP_PENALTY[][2] = {
     { -11, 4 },
     { -10, -1 }
 };
-#define Vector __m256i
-#define D_IND(i, j) (MAX_PATH_LENGTH * LANES_COUNT_SHORT * (i) + \
-            LANES_COUNT_SHORT * (j))
+#define D_IND(i, j) (MAX_PATH_LENGTH * MAX_LANES_COUNT * (i) + \
+            MAX_LANES_COUNT * (j))
+
+#ifdef _MSC_VER
+    #define SWIMD_TARGET(isa)
+#else
+    #define SWIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
@@ -75,8 +115,8 @@ static int GAP_PENALTY[][2] = {
 #ifdef _WIN32
 typedef DWORD (*swimd_thread_callback)(LPVOID);
 
-static void swimd_thread_create(HANDLE *t, swimd_thread_callback callback) {
-    *t = CreateThread(NULL, 0, callback, NULL, 0, NULL);
+static void swimd_thread_create(HANDLE *t, swimd_thread_callback callback, void *param) {
+    *t = CreateThread(NULL, 0, callback, param, 0, NULL);
 }
 
 static void swimd_thread_join(HANDLE *t) {
@@ -111,6 +151,10 @@ static void swimd_are_wait(HANDLE *ev) {
     WaitForSingleObject(*ev, INFINITE);
 }
 
+static bool swimd_are_wait_timeout(HANDLE *ev, int timeout_ms) {
+    return WaitForSingleObject(*ev, timeout_ms) == WAIT_OBJECT_0;
+}
+
 static void swimd_are_set(HANDLE *ev) {
     SetEvent(*ev);
 }
@@ -138,11 +182,67 @@ static void swimd_mre_reset(HANDLE *ev) {
 static void swimd_mre_close(HANDLE *ev) {
     CloseHandle(*ev);
 }
+
+static long swimd_atomic_fetch_add(volatile long *value, long add) {
+    return InterlockedExchangeAdd(value, add);
+}
+
+static bool swimd_atomic_cas(volatile long *value, long expected, long desired) {
+    return InterlockedCompareExchange(value, desired, expected) == expected;
+}
+
+static int swimd_cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+static void* swimd_aligned_alloc(size_t size) {
+    return _aligned_malloc(size, SWIMD_ALIGNMENT);
+}
+
+static void swimd_aligned_free(void *ptr, size_t size) {
+    _aligned_free(ptr);
+}
+
+static void* swimd_file_map(const char *path, size_t *size) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    LARGE_INTEGER file_size;
+    void *ptr = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = (size_t)file_size.QuadPart;
+    }
+    CloseHandle(file);
+    return ptr;
+}
+
+static void swimd_file_unmap(void *ptr, size_t size) {
+    UnmapViewOfFile(ptr);
+}
+
+static bool swimd_file_replace(const char *from, const char *to) {
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static FILE* swimd_file_create_temp(const char *path, char **tmp_path) {
+    int length = strlen(path) + 16;
+    *tmp_path = malloc(length * sizeof(char));
+    snprintf(*tmp_path, length, "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
+    return fopen(*tmp_path, "wbx");
+}
 #else
 typedef void* (*swimd_thread_callback)(void*);
 
-static void swimd_thread_create(pthread_t *t, swimd_thread_callback callback) {
-    pthread_create(t, NULL, callback, NULL);
+static void swimd_thread_create(pthread_t *t, swimd_thread_callback callback, void *param) {
+    pthread_create(t, NULL, callback, param);
 }
 
 static void swimd_thread_join(pthread_t *t) {
@@ -189,6 +289,26 @@ static void swimd_are_wait(SwimdAutoResetEvent *ev) {
     pthread_mutex_unlock(&ev->mutex);
 }
 
+static bool swimd_are_wait_timeout(SwimdAutoResetEvent *ev, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&ev->mutex);
+    while (!ev->signaled) {
+        if (pthread_cond_timedwait(&ev->condition, &ev->mutex, &deadline) != 0)
+            break;
+    }
+    bool signaled = ev->signaled;
+    ev->signaled = false;
+    pthread_mutex_unlock(&ev->mutex);
+    return signaled;
+}
+
 static void swimd_are_set(SwimdAutoResetEvent *ev) {
     pthread_mutex_lock(&ev->mutex);
     ev->signaled = true;
@@ -238,6 +358,87 @@ static void swimd_mre_close(SwimdManualResetEvent *ev) {
     pthread_mutex_destroy(&ev->mutex);
     pthread_cond_destroy(&ev->condition);
 }
+
+static long swimd_atomic_fetch_add(volatile long *value, long add) {
+    return __atomic_fetch_add(value, add, __ATOMIC_SEQ_CST);
+}
+
+static bool swimd_atomic_cas(volatile long *value, long expected, long desired) {
+    return __atomic_compare_exchange_n(value, &expected, desired, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static int swimd_cpu_count(void) {
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// Anything spanning huge pages is mapped directly so the kernel can back it
+// with them, the mapping decision only depends on size so free can repeat it.
+static void* swimd_aligned_alloc(size_t size) {
+    if (size >= SWIMD_HUGE_PAGE_SIZE) {
+        void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+        return ptr;
+    }
+    void *ptr;
+    if (posix_memalign(&ptr, SWIMD_ALIGNMENT, size) != 0)
+        return NULL;
+    return ptr;
+}
+
+static void swimd_aligned_free(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return;
+    if (size >= SWIMD_HUGE_PAGE_SIZE)
+        munmap(ptr, size);
+    else
+        free(ptr);
+}
+
+// Read only private mapping of a whole file, NULL when it is missing or empty.
+static void* swimd_file_map(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *ptr = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED)
+            ptr = NULL;
+        *size = st.st_size;
+    }
+    close(fd);
+    return ptr;
+}
+
+static void swimd_file_unmap(void *ptr, size_t size) {
+    munmap(ptr, size);
+}
+
+static bool swimd_file_replace(const char *from, const char *to) {
+    return rename(from, to) == 0;
+}
+
+// New file with a unique name next to path, for a write that is renamed over it.
+static FILE* swimd_file_create_temp(const char *path, char **tmp_path) {
+    int length = strlen(path) + 8;
+    *tmp_path = malloc(length * sizeof(char));
+    snprintf(*tmp_path, length, "%s.XXXXXX", path);
+    int fd = mkstemp(*tmp_path);
+    if (fd < 0)
+        return NULL;
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        remove(*tmp_path);
+    }
+    return f;
+}
 #endif
 
 typedef enum {
@@ -248,8 +449,8 @@ typedef enum {
 } SwimdLogLevel;
 
 typedef struct  {
-    char *path;
-    char *name;
+    char *path; // into paths of the result
+    char *name; // tail of path
     int score;
 } SwimdProcessInputResultItem;
 
@@ -258,8 +459,59 @@ typedef struct {
     int scanned_items_count;
     SwimdProcessInputResultItem *items;
     int items_length;
+    char *paths; // NUL terminated paths of all items
+    int paths_length;
+    int items_capacity; // rows items and paths have room for, see swimd_hits_print
 } SwimdProcessInputResult;
 
+typedef struct {
+    int index; // into files of the snapshot
+    int score;
+} SwimdQueryHit;
+
+// Rows of a query without their paths, best first. The paths are printed on
+// demand by swimd_query_hits_print while the snapshot stays the same.
+typedef struct SwimdScanner SwimdScanner;
+typedef struct {
+    SwimdScanner *scanner;
+    long generation; // of the snapshot the indices point into
+    bool scan_in_progress;
+    int scanned_items_count;
+    SwimdQueryHit *arr;
+    int length;
+    int capacity;
+} SwimdQueryHits;
+
+static void swimd_scan_process_input_free(SwimdProcessInputResult *result) {
+    free(result->items);
+    free(result->paths);
+    *result = (SwimdProcessInputResult){0};
+}
+
+static void swimd_query_hits_free(SwimdQueryHits *hits) {
+    free(hits->arr);
+    hits->arr = NULL;
+    hits->length = 0;
+    hits->capacity = 0;
+}
+
+// Result of the FFI entry points, the caller owns both arrays and reuses them.
+// Mirrored by the ffi.cdef in init.lua.
+typedef struct {
+    int score;
+    int path_offset; // into paths, NUL terminated
+    int name_offset;
+} SwimdFfiItem;
+
+typedef struct {
+    int scan_in_progress;
+    int scanned_items_count;
+    int items_length;
+    int paths_size; // bytes of paths, set by the caller
+    SwimdFfiItem *items; // one per requested row
+    char *paths;
+} SwimdFfiResult;
+
 typedef struct SwimdFolderStruct SwimdFolderStruct;
 
 typedef struct {
@@ -274,6 +526,9 @@ typedef struct SwimdFolderStruct
     int name_length;
     SwimdFolderStructList folder_lst;
     struct SwimdFolderStruct *parent;
+    // printed prefix of its files, built on first use, see swimd_folder_prefix
+    char *path;
+    int path_length;
 } SwimdFolderStruct;
 
 typedef struct {
@@ -289,10 +544,60 @@ typedef struct {
 } SwimdFileList;
 
 typedef struct {
-    short *arr;
+    uint8_t *arr;
     int length;
+
+    // last ROWS_CACHE_DEPTH dp rows of the block, row of level l lives in slot l % ROWS_CACHE_DEPTH
+    short *rows;
+    int rows_level_min;
+    int rows_level_max;
+
+    // summary for pruning, see swimd_block_can_score
+    int min_length;
+    uint64_t chars_mask;
 } SwimdFileVec;
 
+// Computes dp row i of a block in place over row i - 1, diag and left are the
+// border cells d[i - 1][0] and d[i][0].
+typedef void (*swimd_row_func)(short *row,
+        const uint8_t *haystack_vec,
+        int haystack_max_length,
+        short needle_char,
+        short needle_char_inverse,
+        short gap_pen,
+        short diag,
+        short left,
+        const short *gap_distr_fun);
+
+// Same row in 8 bit cells biased by swimd_byte_bias, level is i. When row_in is
+// set row i - 1 is taken from that 16 bit row instead of row, when row_out is
+// set row i is also written there in 16 bits. Both may point to the same row.
+typedef void (*swimd_byte_row_func)(signed char *row,
+        const short *row_in,
+        short *row_out,
+        const uint8_t *haystack_vec,
+        int haystack_max_length,
+        int level,
+        short needle_char,
+        short needle_char_inverse,
+        const short *gap_distr_fun,
+        const short *gap_distr_sum);
+
+typedef struct {
+    const char *name;
+    int lanes;
+    swimd_row_func row;
+    swimd_byte_row_func byte_row;
+    bool (*supported)(void);
+} SwimdKernel;
+
+static SwimdKernel swimd_kernel = {0};
+
+typedef enum {
+    SWIMD_PACK_SCAN_ORDER,
+    SWIMD_PACK_LENGTH_SORTED,
+} SwimdPackMode;
+
 typedef struct {
     int score;
     int index;
@@ -310,24 +615,54 @@ typedef void (*swimd_scanning_func)(const char*,
         SwimdFolderStruct*,
         bool);
 
-typedef struct {
-    bool initialized;
-
-    char *needle;
-    int needle_length;
-    short *needle_vec;
-    int needle_vec_length;
-
+// Everything a query reads about one scan of the tree. A scan builds a new
+// snapshot on the side and publishes it with a pointer swap, the old one is
+// freed once the queries that still hold it are done, see swimd_snapshot_publish.
+typedef struct SwimdSnapshot {
+    volatile long refs; // the published pointer and every query that acquired it
+    char *scan_path;
+    char *base_path;
     SwimdFileList *files;
+    SwimdFolderStruct *folders;
+
     SwimdFileVec *files_vec;
     int files_vec_length;
+    int *files_vec_index; // lane slot -> files->arr index, -1 for padding lanes
+    uint8_t *files_vec_arena; // blocks followed by their rows caches
+    size_t files_vec_arena_size;
+    int files_vec_arena_length; // blocks past it were added by the watch, allocated one by one
+
+    char *rows_needle;
+    int rows_prefix_length;
 
-    SwimdFolderStruct *folders;
     short *scores;
     int scores_length;
+
+    struct SwimdWatch *watch; // inotify watches of the tree, files scanner only
+    bool partial; // published while the initial scan still runs
+    bool cached; // loaded from the index of an earlier scan, see swimd_index_load
+    void *index_map; // names and blocks of a cached snapshot point into it
+    size_t index_map_size;
+    long generation; // new on every publish and removal of files, see swimd_snapshot_stamp
+    // newer snapshot whose names, folders and watch this one reads, it only
+    // owns its arrays, see swimd_snapshot_lock
+    struct SwimdSnapshot *tree_owner;
+} SwimdSnapshot;
+
+typedef struct SwimdScanner {
+    bool initialized;
+
+    char *needle;
+    int needle_length;
+    uint64_t *needle_chars_mask;
+
+    SwimdSnapshot *volatile snapshot;
     SwimdScoresHeap scores_heap;
+    // reused by every call of the FFI entry points, which only run on the
+    // editor thread, see swimd_query_ffi
+    SwimdQueryHits ffi_hits;
+    SwimdProcessInputResult ffi_result;
 
-    short *d_vec;
     short *gap_distr_fun;
     short *gap_distr_sum;
 
@@ -336,27 +671,110 @@ typedef struct {
     HANDLE scan_begin;
     HANDLE scan_started;
     HANDLE scan_finished;
-    CRITICAL_SECTION scan_state_swap;
+    CRITICAL_SECTION scan_state_lock;
+    CRITICAL_SECTION snapshot_lock;
 #else
     pthread_t scan_thread;
     SwimdAutoResetEvent scan_begin;
     SwimdAutoResetEvent scan_started;
     SwimdManualResetEvent scan_finished;
-    pthread_mutex_t scan_state_swap;
+    pthread_mutex_t scan_state_lock; // serializes queries and in place edits of the snapshot
+    pthread_mutex_t snapshot_lock; // only held to load the pointer and take a reference
+    int scan_wake_fd; // eventfd written along scan_begin for a thread blocked on its watch
 #endif
     volatile bool scan_terminate;
     volatile bool scan_cancelled;
     volatile bool scan_in_progress;
     volatile bool scan_is_refreshing;
     char *scan_path;
-    char *base_path;
-    int scan_files_count;
-    int scan_files_refresh_count;
+    volatile long scan_files_count;
+    volatile long scan_files_refresh_count;
+    int notify_files_count; // files of the partial snapshot at the last notification
+
+    struct SwimdWatch *scan_watch; // watches of the tree being scanned
+    volatile bool watching; // the published snapshot has a watch
+    volatile bool watch_overflowed;
+    bool scan_unchanged; // set by a refresh that found the tree as it was
+
+    // git scanner only, kept between scans, see swimd_list_git
+    git_repository *git_repo;
+    git_oid git_index_checksum;
+    uint64_t git_untracked_hash;
+    struct SwimdGitStamps *git_stamps; // of the last untracked walk, NULL on Windows
+    bool git_state_valid;
 
     swimd_scanning_func scanning_func;
     swimd_thread_callback scanning_loop;
 } SwimdScanner;
 
+typedef struct {
+    short *row;
+    signed char *byte_row;
+    SwimdScoresHeap scores_heap;
+    int match_count;
+    int pruned_count;
+
+#ifdef _WIN32
+    HANDLE thread;
+    HANDLE work_begin;
+    HANDLE work_done;
+#else
+    pthread_t thread;
+    SwimdAutoResetEvent work_begin;
+    SwimdAutoResetEvent work_done;
+#endif
+} SwimdScoreWorker;
+
+typedef struct {
+    SwimdScoreWorker *workers;
+    int workers_count;
+    short *gap_distr_fun;
+    short *gap_distr_sum;
+    short *border_row;
+
+    SwimdScanner *scanner;
+    SwimdSnapshot *snapshot;
+    int max_size;
+    long query_id; // asynchronous query being scored, 0 for a synchronous one
+    volatile long next_block;
+    volatile long prune_score;
+    volatile bool terminate;
+
+#ifdef _WIN32
+    CRITICAL_SECTION work_lock;
+#else
+    pthread_mutex_t work_lock;
+#endif
+} SwimdScorePool;
+
+typedef struct {
+    char *needle; // NULL when nothing is pending
+    int max_size;
+    int scanner_index;
+    long id;
+} SwimdQueryRequest;
+
+// Queries submitted from the editor are scored on a thread of their own. Only
+// the latest submission matters, a newer one replaces the pending request and
+// aborts the scoring of the one in flight, see swimd_query_submit.
+typedef struct {
+#ifdef _WIN32
+    HANDLE thread;
+    HANDLE work_begin;
+    CRITICAL_SECTION lock;
+#else
+    pthread_t thread;
+    SwimdAutoResetEvent work_begin;
+    pthread_mutex_t lock;
+#endif
+    SwimdQueryRequest pending;
+    volatile long submitted_id;
+    long done_id;
+    bool done_polled;
+    SwimdQueryHits result; // of done_id until it is polled
+    volatile bool terminate;
+} SwimdQueryQueue;
+
 static void swimd_list_files(const char *root_dir,
         char *base_path,
         SwimdFileList *file_list,
@@ -376,8 +794,30 @@ static void* swimd_scanning_loop_git(void *lp_param);
 static void* swimd_scanning_loop_files(void *lp_param);
 #endif
 
+static void swimd_snapshot_stream(SwimdScanner *scanner, SwimdFileList *chunk);
+static void swimd_list_directories_free(const SwimdFileList *lst,
+        SwimdFolderStruct *root_folder);
+static void swimd_kernel_init(void);
+static void swimd_score_pool_init(void);
+static void swimd_score_pool_free(void);
+static void swimd_notify_init(void);
+static void swimd_notify_free(void);
+
 static bool swimd_initialized = false;
 static SwimdScanner swimd_scanners[SCANNER_COUNT] = {0};
+static SwimdScorePool swimd_score_pool = {0};
+static SwimdQueryQueue swimd_query_queue = {0};
+static SwimdPackMode swimd_pack_mode = SWIMD_PACK_LENGTH_SORTED;
+// .gitignore style patterns pruned by the files scanner on top of ignore files
+static const char *swimd_prune_list_default[] = { ".git/" };
+static char **swimd_prune_list = (char**)swimd_prune_list_default;
+static int swimd_prune_list_length = 1;
+static bool swimd_watch_enabled = false;
+static char *swimd_index_dir = NULL;
+// readable while events are pending, so the editor waits on it instead of
+// polling, see swimd_notify
+static int swimd_notify_fd = -1;
+static volatile long swimd_notify_events = 0;
 static FILE *swimd_log = {0};
 static bool swimd_log_enabled = false;
 
@@ -412,6 +852,9 @@ static void swimd_global_init(const char *log_path) {
     swimd_git2_init();
     swimd_scanner_init_git();
     swimd_scanner_init_files();
+    swimd_kernel_init();
+    swimd_score_pool_init();
+    swimd_notify_init();
 }
 
 static void swimd_log_free(void) {
@@ -426,7 +869,23 @@ static void swimd_git2_free(void) {
     git_libgit2_shutdown();
 }
 
+static void swimd_prune_list_free(void) {
+    if (swimd_prune_list != (char**)swimd_prune_list_default) {
+        for (int i = 0; i < swimd_prune_list_length; i++) {
+            free(swimd_prune_list[i]);
+        }
+        free(swimd_prune_list);
+    }
+    swimd_prune_list = (char**)swimd_prune_list_default;
+    swimd_prune_list_length = 1;
+}
+
 static void swimd_global_free(void) {
+    swimd_prune_list_free();
+    free(swimd_index_dir);
+    swimd_index_dir = NULL;
+    swimd_score_pool_free();
+    swimd_notify_free();
     swimd_git2_free();
     swimd_log_free();
 }
@@ -504,6 +963,51 @@ static void swimd_log_append(SwimdLogLevel level, const char *msg, ...) {
     fflush(swimd_log);
 }
 
+static void swimd_notify_init(void) {
+#ifndef _WIN32
+    swimd_notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (swimd_notify_fd < 0)
+        swimd_log_append(SWIMD_WARN, "Unable to create notify fd, errno %d", errno);
+#endif
+}
+
+static void swimd_notify_free(void) {
+#ifndef _WIN32
+    if (swimd_notify_fd >= 0)
+        close(swimd_notify_fd);
+#endif
+    swimd_notify_fd = -1;
+    swimd_notify_events = 0;
+}
+
+// The events go to a mask first, the fd only wakes the editor up.
+static void swimd_notify(long events) {
+    while (1) {
+        long pending = swimd_notify_events;
+        if (swimd_atomic_cas(&swimd_notify_events, pending, pending | events))
+            break;
+    }
+#ifndef _WIN32
+    uint64_t one = 1;
+    if (swimd_notify_fd >= 0 && write(swimd_notify_fd, &one, sizeof(one)) < 0)
+        swimd_log_append(SWIMD_WARN, "Unable to signal notify fd, errno %d", errno);
+#endif
+}
+
+// Events since the last drain, the fd is readable again only after a new one.
+static long swimd_notify_drain(void) {
+#ifndef _WIN32
+    uint64_t count;
+    if (swimd_notify_fd >= 0 && read(swimd_notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        swimd_log_append(SWIMD_WARN, "Unable to drain notify fd, errno %d", errno);
+#endif
+    while (1) {
+        long pending = swimd_notify_events;
+        if (swimd_atomic_cas(&swimd_notify_events, pending, 0))
+            return pending;
+    }
+}
+
 static void swimd_folders_init(SwimdFolderStructList *lst) {
     int default_size = 4;
     lst->arr = malloc(default_size * sizeof(SwimdFolderStruct*));
@@ -531,17 +1035,30 @@ static void swimd_file_list_init(SwimdFileList *lst) {
     lst->capacity = default_size;
 }
 
-static void swimd_file_list_append(SwimdFileList *lst, SwimdFile file) {
+static void swimd_file_list_push(SwimdFileList *lst, SwimdFile file) {
     if (lst->length == lst->capacity) {
         lst->capacity = lst->capacity * 2;
         lst->arr = realloc(lst->arr, lst->capacity * sizeof(SwimdFile));
     }
     lst->arr[lst->length] = file;
     lst->length++;
+}
+
+static void swimd_file_list_append(SwimdFileList *lst, SwimdFile file) {
+    swimd_file_list_push(lst, file);
     if (lst->length % 10000 == 0)
         swimd_log_append(SWIMD_INFO, "Scanned file count %d", lst->length);
 }
 
+static void swimd_file_list_append_all(SwimdFileList *lst, const SwimdFileList *src) {
+    if (lst->length + src->length > lst->capacity) {
+        lst->capacity = MAX(lst->capacity * 2, lst->length + src->length);
+        lst->arr = realloc(lst->arr, lst->capacity * sizeof(SwimdFile));
+    }
+    memcpy(&lst->arr[lst->length], src->arr, src->length * sizeof(SwimdFile));
+    lst->length += src->length;
+}
+
 static void swimd_file_list_free(SwimdFileList *lst) {
     lst->length = 0;
     free(lst->arr);
@@ -584,6 +1101,7 @@ static void swimd_list_files_win32(const char *root_dir,
                 folder_node->name = folder_name;
                 folder_node->name_length = current_file_len;
                 folder_node->parent = root_folder;
+                folder_node->path = NULL;
 
                 swimd_folders_init(&folder_node->folder_lst);
                 swimd_folders_append(&root_folder->folder_lst, folder_node);
@@ -630,70 +1148,884 @@ static void swimd_list_files_win32(const char *root_dir,
 }
 #else
 
-static void swimd_list_files_linux(const char *root_dir,
-        SwimdFileList *file_list,
-        SwimdFolderStruct *root_folder,
-        bool refreshing) {
-    SwimdScanner *scanner = &swimd_scanners[SCANNER_FILES];
-    char inner_folder[MAX_PATH_LENGTH];
-    struct dirent *entry;
-    DIR *dp = opendir(root_dir);
-    if (dp == NULL) {
-        swimd_log_append(SWIMD_ERR, "Unable to opendir %s", root_dir);
-        return;
+typedef struct {
+    char *glob;
+    bool negate;
+    bool dir_only;
+    bool anchored; // matched against the path relative to the level folder, else the name
+} SwimdIgnorePattern;
+
+// Ignore patterns of one directory level, compiled once when the directory is
+// read. Children share the innermost level and reach the outer ones through
+// parent, the user prune list is the outermost level at the scan root.
+typedef struct SwimdIgnore {
+    SwimdIgnorePattern *arr;
+    int length;
+    int capacity;
+    SwimdFolderStruct *folder;
+    struct SwimdIgnore *parent;
+    struct SwimdIgnore *next; // levels created by the same walker thread, then by the watch
+} SwimdIgnore;
+
+static SwimdIgnore* swimd_ignore_new(SwimdFolderStruct *folder, SwimdIgnore *parent) {
+    SwimdIgnore *ignore = malloc(sizeof(SwimdIgnore));
+    ignore->capacity = 4;
+    ignore->arr = malloc(ignore->capacity * sizeof(SwimdIgnorePattern));
+    ignore->length = 0;
+    ignore->folder = folder;
+    ignore->parent = parent;
+    ignore->next = NULL;
+    return ignore;
+}
+
+static void swimd_ignore_free(SwimdIgnore *ignore) {
+    while (ignore != NULL) {
+        SwimdIgnore *next = ignore->next;
+        for (int i = 0; i < ignore->length; i++) {
+            free(ignore->arr[i].glob);
+        }
+        free(ignore->arr);
+        free(ignore);
+        ignore = next;
     }
+}
 
-    while ((entry = readdir(dp))) {
-        const char *current_file = entry->d_name;
-        int current_file_len = strlen(current_file);
-        if (entry->d_type == DT_DIR) {
-            if (strcmp(current_file, ".") != 0 && strcmp(current_file, "..") != 0) {
-                char *folder_name = malloc((current_file_len + 1) * sizeof(char));
-                strcpy(folder_name, current_file);
-                folder_name[current_file_len] = '\0';
-
-                SwimdFolderStruct *folder_node = malloc(sizeof(SwimdFolderStruct));
-                folder_node->name = folder_name;
-                folder_node->name_length = current_file_len;
-                folder_node->parent = root_folder;
+// One line in the .gitignore syntax: '#' comments, '!' negation, a trailing
+// '/' for directories only and any other '/' anchoring it to the level folder.
+static void swimd_ignore_add(SwimdIgnore *ignore, const char *line, int length) {
+    while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\r'))
+        length--;
+    if (length == 0 || line[0] == '#')
+        return;
 
-                swimd_folders_init(&folder_node->folder_lst);
-                swimd_folders_append(&root_folder->folder_lst, folder_node);
+    SwimdIgnorePattern pattern = {0};
+    if (line[0] == '!') {
+        pattern.negate = true;
+        line++;
+        length--;
+    }
+    if (length > 0 && line[length - 1] == '/') {
+        pattern.dir_only = true;
+        length--;
+    }
+    for (int i = 0; i < length; i++) {
+        if (line[i] == '/')
+            pattern.anchored = true;
+    }
+    if (length > 0 && line[0] == '/') {
+        line++;
+        length--;
+    }
+    if (length == 0)
+        return;
 
-                strcpy(inner_folder, root_dir);
-                strcat(inner_folder, "/");
-                strcat(inner_folder, current_file);
+    pattern.glob = malloc(length + 1);
+    memcpy(pattern.glob, line, length);
+    pattern.glob[length] = '\0';
 
-                swimd_list_files_linux(inner_folder, file_list, folder_node, refreshing);
-            }
-        } else if (entry->d_type == DT_REG) {
-            char *file_name = malloc((current_file_len + 1) * sizeof(char));
-            strcpy(file_name, current_file);
-            file_name[current_file_len] = '\0';
+    if (ignore->length == ignore->capacity) {
+        ignore->capacity = ignore->capacity * 2;
+        ignore->arr = realloc(ignore->arr, ignore->capacity * sizeof(SwimdIgnorePattern));
+    }
+    ignore->arr[ignore->length++] = pattern;
+}
 
-            SwimdFile file_node = {
-                .name = file_name,
-                .name_length = current_file_len,
-                .folder = root_folder
-            };
+static void swimd_ignore_add_lines(SwimdIgnore *ignore, const char *text, long length) {
+    long line_begin = 0;
+    for (long i = 0; i <= length; i++) {
+        if (i == length || text[i] == '\n') {
+            swimd_ignore_add(ignore, &text[line_begin], i - line_begin);
+            line_begin = i + 1;
+        }
+    }
+}
 
-            swimd_file_list_append(file_list, file_node);
-            if (!refreshing)
-                scanner->scan_files_count++;
-            else
-                scanner->scan_files_refresh_count++;
+static void swimd_ignore_load(SwimdIgnore *ignore, int dir_fd, const char *file_name) {
+    int fd = openat(dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *text = malloc(st.st_size);
+        long length = 0;
+        while (length < st.st_size) {
+            long read_length = read(fd, text + length, st.st_size - length);
+            if (read_length <= 0)
+                break;
+            length += read_length;
+        }
+        swimd_ignore_add_lines(ignore, text, length);
+        free(text);
+    }
+    close(fd);
+}
+
+// '*' and '?' stay within a path segment, '**' spans segments and "**/" may
+// also match no segment at all, [...] is a char class negated by '!' or '^'.
+static bool swimd_glob_match(const char *pattern, const char *text) {
+    while (*pattern != '\0') {
+        if (pattern[0] == '*' && pattern[1] == '*') {
+            const char *rest = pattern + 2;
+            if (*rest == '/' && swimd_glob_match(rest + 1, text))
+                return true;
+            for (const char *t = text; ; t++) {
+                if (swimd_glob_match(rest, t))
+                    return true;
+                if (*t == '\0')
+                    return false;
+            }
+        }
+        if (*pattern == '*') {
+            pattern++;
+            for (const char *t = text; ; t++) {
+                if (swimd_glob_match(pattern, t))
+                    return true;
+                if (*t == '\0' || *t == '/')
+                    return false;
+            }
         }
+        if (*text == '\0')
+            return false;
+        if (*pattern == '?') {
+            if (*text == '/')
+                return false;
+            pattern++;
+            text++;
+            continue;
+        }
+        if (*pattern == '[') {
+            const char *p = pattern + 1;
+            bool negate = *p == '!' || *p == '^';
+            if (negate)
+                p++;
+            unsigned char c = *text;
+            bool matched = false;
+            bool first = true;
+            while (*p != '\0' && (first || *p != ']')) {
+                first = false;
+                unsigned char lo = *p;
+                unsigned char hi = lo;
+                if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+                    hi = p[2];
+                    p += 3;
+                } else {
+                    p++;
+                }
+                if (c >= lo && c <= hi)
+                    matched = true;
+            }
+            if (*p == ']') {
+                if (matched == negate || c == '/')
+                    return false;
+                pattern = p + 1;
+                text++;
+                continue;
+            }
+            // no closing bracket, '[' is literal
+        }
+        if (*pattern == '\\' && pattern[1] != '\0')
+            pattern++;
+        if (*pattern != *text)
+            return false;
+        pattern++;
+        text++;
+    }
+    return *text == '\0';
+}
+
+static bool swimd_folder_relative_path(char *buf,
+        int size,
+        SwimdFolderStruct *base,
+        SwimdFolderStruct *folder,
+        const char *name) {
+    int name_length = strlen(name);
+    int length = name_length;
+    for (SwimdFolderStruct *f = folder; f != base; f = f->parent) {
+        length += f->name_length + 1;
+    }
+    if (length >= size)
+        return false;
+    buf[length] = '\0';
+    int pos = length - name_length;
+    memcpy(&buf[pos], name, name_length);
+    for (SwimdFolderStruct *f = folder; f != base; f = f->parent) {
+        buf[--pos] = '/';
+        pos -= f->name_length;
+        memcpy(&buf[pos], f->name, f->name_length);
+    }
+    return true;
+}
+
+// Deeper levels and later patterns win, like in git.
+static bool swimd_ignore_match(SwimdIgnore *ignore,
+        SwimdFolderStruct *folder,
+        const char *name,
+        bool is_dir) {
+    char relative_path[1024];
+    for (SwimdIgnore *level = ignore; level != NULL; level = level->parent) {
+        bool relative_ready = false;
+        bool relative_valid = false;
+        for (int i = level->length - 1; i >= 0; i--) {
+            SwimdIgnorePattern *pattern = &level->arr[i];
+            if (pattern->dir_only && !is_dir)
+                continue;
+            bool hit;
+            if (pattern->anchored) {
+                if (!relative_ready) {
+                    relative_valid = swimd_folder_relative_path(relative_path,
+                            sizeof(relative_path),
+                            level->folder,
+                            folder,
+                            name);
+                    relative_ready = true;
+                }
+                hit = relative_valid && swimd_glob_match(pattern->glob, relative_path);
+            } else {
+                hit = swimd_glob_match(pattern->glob, name);
+            }
+            if (hit)
+                return !pattern->negate;
+        }
+    }
+    return false;
+}
 
-        if (scanner->scan_cancelled)
-            break;
+typedef struct {
+    SwimdFolderStruct *folder;
+    SwimdIgnore *ignore; // level in effect for the folder entries
+} SwimdWatchEntry;
+
+// inotify watches of the files scanner tree, entries are indexed by watch
+// descriptor. The ignore levels of the tree are kept here rather than freed
+// after the walk, so later events are filtered the same way.
+typedef struct SwimdWatch {
+    int fd;
+    SwimdWatchEntry *arr;
+    int capacity;
+    pthread_mutex_t lock;
+    SwimdIgnore *ignores;
+    int removed_count; // files dropped from the list since it was packed
+    bool limit_reported;
+} SwimdWatch;
+
+#define SWIMD_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+static SwimdWatch* swimd_watch_new(void) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        swimd_log_append(SWIMD_ERR, "Unable to init inotify, errno %d", errno);
+        return NULL;
+    }
+    SwimdWatch *watch = malloc(sizeof(SwimdWatch));
+    watch->fd = fd;
+    watch->capacity = 64;
+    watch->arr = calloc(watch->capacity, sizeof(SwimdWatchEntry));
+    swimd_crit_init(&watch->lock);
+    watch->ignores = NULL;
+    watch->removed_count = 0;
+    watch->limit_reported = false;
+    return watch;
+}
+
+static void swimd_watch_free(SwimdWatch *watch) {
+    if (watch == NULL)
+        return;
+    close(watch->fd);
+    free(watch->arr);
+    swimd_crit_close(&watch->lock);
+    swimd_ignore_free(watch->ignores);
+    free(watch);
+}
+
+// Called by the walker threads before a directory is read, so entries created
+// while it is read are reported as well. The watch is added through the
+// directory fd, no path is built.
+static int swimd_watch_add(SwimdWatch *watch, int dir_fd, SwimdFolderStruct *folder) {
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", dir_fd);
+    int wd = inotify_add_watch(watch->fd, fd_path, SWIMD_WATCH_MASK);
+
+    swimd_crit_lock(&watch->lock);
+    if (wd < 0) {
+        if (!watch->limit_reported) {
+            swimd_log_append(SWIMD_WARN, "Unable to watch directory %s, errno %d, see fs.inotify.max_user_watches",
+                    folder->name,
+                    errno);
+            watch->limit_reported = true;
+        }
+    } else {
+        if (wd >= watch->capacity) {
+            int capacity = MAX(watch->capacity * 2, wd + 1);
+            watch->arr = realloc(watch->arr, capacity * sizeof(SwimdWatchEntry));
+            memset(&watch->arr[watch->capacity], 0, (capacity - watch->capacity) * sizeof(SwimdWatchEntry));
+            watch->capacity = capacity;
+        }
+        watch->arr[wd] = (SwimdWatchEntry){
+            .folder = folder,
+            .ignore = NULL,
+        };
     }
+    swimd_crit_unlock(&watch->lock);
+    return wd;
+}
 
-    closedir(dp);
+static void swimd_watch_set_ignore(SwimdWatch *watch, int wd, SwimdIgnore *ignore) {
+    swimd_crit_lock(&watch->lock);
+    watch->arr[wd].ignore = ignore;
+    swimd_crit_unlock(&watch->lock);
 }
-#endif
 
-static void swimd_list_files(const char *root_dir,
-        char *base_path,
+// Length of the folder path relative to the root with its trailing separator.
+static int swimd_folder_prefix_length(SwimdFolderStruct *folder) {
+    int length = 0;
+    for (; !IS_ROOT_FOLDER(folder); folder = folder->parent) {
+        length += folder->name_length + 1;
+    }
+    return length;
+}
+
+// Open directory shared by the walk items of its subdirectories, closed once
+// the directory itself is read and every subdirectory has been opened from it.
+// Past max_open_dirs the subdirectories are opened from the walk root.
+typedef struct {
+    int fd;
+    volatile long refs;
+} SwimdWalkDir;
+
+typedef struct {
+    SwimdWalkDir *parent;
+    SwimdFolderStruct *folder;
+    SwimdIgnore *ignore;
+    int prefix_length; // of the folder path with its trailing separator
+} SwimdWalkItem;
+
+// Pending directories of one walker thread. The owner pushes and pops at the
+// end, so it goes depth first, idle threads steal from the beginning.
+// Modification time of a directory, or of the .gitignore in it, taken before
+// the walk reads it, see swimd_git_stamps_unchanged.
+typedef struct {
+    SwimdFolderStruct *folder;
+    bool ignore_file;
+    struct timespec mtime;
+} SwimdWalkStamp;
+
+typedef struct {
+    SwimdWalkStamp *arr;
+    int length;
+    int capacity;
+} SwimdWalkStampList;
+
+static void swimd_walk_stamp_push(SwimdWalkStampList *stamps,
+        SwimdFolderStruct *folder,
+        bool ignore_file,
+        struct timespec mtime) {
+    if (stamps->length == stamps->capacity) {
+        stamps->capacity = MAX(stamps->capacity * 2, 64);
+        stamps->arr = realloc(stamps->arr, stamps->capacity * sizeof(SwimdWalkStamp));
+    }
+    stamps->arr[stamps->length++] = (SwimdWalkStamp){
+        .folder = folder,
+        .ignore_file = ignore_file,
+        .mtime = mtime,
+    };
+}
+
+typedef struct {
+    SwimdWalkItem *arr;
+    int begin;
+    int end;
+    int capacity;
+    pthread_mutex_t lock;
+
+    char *dents;
+    long dents_capacity;
+    SwimdIgnore *ignores;
+    SwimdFileList files;
+    int files_streamed;
+    SwimdWalkStampList stamps;
+    pthread_t thread;
+    struct SwimdWalker *walker;
+} SwimdWalkWorker;
+
+typedef struct SwimdWalker {
+    SwimdWalkWorker workers[MAX_WALK_WORKERS];
+    int workers_count;
+    volatile long pending;
+    volatile long open_dirs;
+    long max_open_dirs;
+    volatile long *files_count;
+    // idle workers sleep on work_pushed until pushes moves or pending drops to 0
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_pushed;
+    volatile long pushes;
+    SwimdAutoResetEvent walk_done; // set by the worker that drops pending to 0
+    SwimdScanner *scanner;
+    SwimdWatch *watch;
+    SwimdWalkDir *root; // kept open for the whole walk
+    SwimdFolderStruct *root_folder;
+
+    bool stream;
+    pthread_mutex_t stream_lock;
+    SwimdFileList stream_files; // read so far and not yet handed to the partial snapshot
+
+    bool git_worktree; // only .gitignore files count and nested repositories are not entered
+    SwimdWalkStampList *stamps; // NULL unless the caller keeps them
+} SwimdWalker;
+
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} SwimdDirent64;
+
+static void swimd_walk_push(SwimdWalkWorker *worker, SwimdWalkItem item) {
+    swimd_atomic_fetch_add(&worker->walker->pending, 1);
+    swimd_crit_lock(&worker->lock);
+    if (worker->end == worker->capacity) {
+        int length = worker->end - worker->begin;
+        if (worker->begin > 0) {
+            memmove(worker->arr, &worker->arr[worker->begin], length * sizeof(SwimdWalkItem));
+        } else {
+            worker->capacity = worker->capacity * 2;
+            worker->arr = realloc(worker->arr, worker->capacity * sizeof(SwimdWalkItem));
+        }
+        worker->begin = 0;
+        worker->end = length;
+    }
+    worker->arr[worker->end++] = item;
+    swimd_crit_unlock(&worker->lock);
+
+    SwimdWalker *walker = worker->walker;
+    swimd_crit_lock(&walker->idle_lock);
+    swimd_atomic_fetch_add(&walker->pushes, 1);
+    pthread_cond_signal(&walker->work_pushed);
+    swimd_crit_unlock(&walker->idle_lock);
+}
+
+// Sleeps unless something was pushed since seen_pushes was read, which is done
+// before looking at the queues so no push goes unnoticed.
+static void swimd_walk_wait(SwimdWalker *walker, long seen_pushes) {
+    swimd_crit_lock(&walker->idle_lock);
+    while (walker->pushes == seen_pushes && walker->pending != 0) {
+        pthread_cond_wait(&walker->work_pushed, &walker->idle_lock);
+    }
+    swimd_crit_unlock(&walker->idle_lock);
+}
+
+static bool swimd_walk_pop(SwimdWalkWorker *worker, SwimdWalkItem *item) {
+    bool found = false;
+    swimd_crit_lock(&worker->lock);
+    if (worker->end > worker->begin) {
+        *item = worker->arr[--worker->end];
+        found = true;
+    }
+    swimd_crit_unlock(&worker->lock);
+    return found;
+}
+
+static bool swimd_walk_steal(SwimdWalkWorker *victim, SwimdWalkItem *item) {
+    bool found = false;
+    swimd_crit_lock(&victim->lock);
+    if (victim->end > victim->begin) {
+        *item = victim->arr[victim->begin++];
+        found = true;
+    }
+    swimd_crit_unlock(&victim->lock);
+    return found;
+}
+
+static void swimd_walk_stream(SwimdWalkWorker *worker) {
+    SwimdWalker *walker = worker->walker;
+    SwimdFileList chunk = {
+        .arr = &worker->files.arr[worker->files_streamed],
+        .length = worker->files.length - worker->files_streamed,
+    };
+    swimd_crit_lock(&walker->stream_lock);
+    swimd_file_list_append_all(&walker->stream_files, &chunk);
+    swimd_crit_unlock(&walker->stream_lock);
+    worker->files_streamed = worker->files.length;
+}
+
+static void swimd_walk_stream_flush(SwimdWalker *walker) {
+    swimd_crit_lock(&walker->stream_lock);
+    SwimdFileList chunk = walker->stream_files;
+    swimd_file_list_init(&walker->stream_files);
+    swimd_crit_unlock(&walker->stream_lock);
+    if (chunk.length > 0)
+        swimd_snapshot_stream(walker->scanner, &chunk);
+    swimd_file_list_free(&chunk);
+}
+
+static SwimdWalkDir* swimd_walk_dir_new(SwimdWalker *walker, int fd) {
+    SwimdWalkDir *dir = malloc(sizeof(SwimdWalkDir));
+    dir->fd = fd;
+    dir->refs = 1;
+    swimd_atomic_fetch_add(&walker->open_dirs, 1);
+    return dir;
+}
+
+static void swimd_walk_dir_release(SwimdWalker *walker, SwimdWalkDir *dir) {
+    if (dir == NULL)
+        return;
+    if (swimd_atomic_fetch_add(&dir->refs, -1) == 1) {
+        close(dir->fd);
+        free(dir);
+        swimd_atomic_fetch_add(&walker->open_dirs, -1);
+    }
+}
+
+// Entries are read with getdents64 straight into the worker buffer and
+// subdirectories are opened relative to their parent, so no path is ever built.
+// The whole directory is read before any entry is handled since its ignore
+// files apply to all of its entries. Entries whose relative path would not fit
+// in MAX_PATH_LENGTH are skipped, they could not be printed.
+static void swimd_walk_dir(SwimdWalkWorker *worker,
+        SwimdWalkDir *dir,
+        SwimdFolderStruct *folder,
+        SwimdIgnore *ignore,
+        int prefix_length) {
+    SwimdWalker *walker = worker->walker;
+    int wd = walker->watch != NULL ? swimd_watch_add(walker->watch, dir->fd, folder) : -1;
+    struct stat st;
+    if (walker->stamps != NULL && fstat(dir->fd, &st) == 0)
+        swimd_walk_stamp_push(&worker->stamps, folder, false, st.st_mtim);
+    long dents_length = 0;
+    while (!walker->scanner->scan_cancelled) {
+        if (worker->dents_capacity - dents_length < WALK_DENTS_BUFFER_SIZE) {
+            worker->dents_capacity = worker->dents_capacity * 2;
+            worker->dents = realloc(worker->dents, worker->dents_capacity);
+        }
+        long read_length = syscall(SYS_getdents64,
+                dir->fd,
+                worker->dents + dents_length,
+                worker->dents_capacity - dents_length);
+        if (read_length < 0) {
+            swimd_log_append(SWIMD_ERR, "Unable to read directory %s", folder->name);
+            return;
+        }
+        if (read_length == 0)
+            break;
+        dents_length += read_length;
+    }
+
+    const char *ignore_files[] = { ".gitignore", ".ignore" };
+    bool ignore_files_found[] = { false, false };
+    int ignore_files_count = walker->git_worktree ? 1 : 2;
+    for (long pos = 0; pos < dents_length;) {
+        SwimdDirent64 *entry = (SwimdDirent64*)(worker->dents + pos);
+        pos += entry->d_reclen;
+        for (int i = 0; i < ignore_files_count; i++) {
+            if (strcmp(entry->d_name, ignore_files[i]) == 0)
+                ignore_files_found[i] = true;
+        }
+        // a nested repository or submodule has a tree of its own
+        if (walker->git_worktree && !IS_ROOT_FOLDER(folder) && strcmp(entry->d_name, ".git") == 0)
+            return;
+    }
+    SwimdIgnore *level = NULL;
+    for (int i = 0; i < ignore_files_count; i++) {
+        if (!ignore_files_found[i])
+            continue;
+        if (level == NULL) {
+            level = swimd_ignore_new(folder, ignore);
+            level->next = worker->ignores;
+            worker->ignores = level;
+        }
+        if (walker->stamps != NULL && fstatat(dir->fd, ignore_files[i], &st, 0) == 0)
+            swimd_walk_stamp_push(&worker->stamps, folder, true, st.st_mtim);
+        swimd_ignore_load(level, dir->fd, ignore_files[i]);
+    }
+    if (level != NULL)
+        ignore = level;
+    if (wd >= 0)
+        swimd_watch_set_ignore(walker->watch, wd, ignore);
+    bool share_dir = walker->open_dirs < walker->max_open_dirs;
+
+    for (long pos = 0; pos < dents_length;) {
+        SwimdDirent64 *entry = (SwimdDirent64*)(worker->dents + pos);
+        pos += entry->d_reclen;
+
+        const char *current_file = entry->d_name;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dir->fd, current_file, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type != DT_DIR && type != DT_REG)
+            continue;
+        if (type == DT_DIR && (strcmp(current_file, ".") == 0 || strcmp(current_file, "..") == 0))
+            continue;
+        if (ignore != NULL && swimd_ignore_match(ignore, folder, current_file, type == DT_DIR))
+            continue;
+
+        int current_file_len = strlen(current_file);
+        if (prefix_length + current_file_len >= MAX_PATH_LENGTH)
+            continue;
+        if (type == DT_DIR) {
+            char *folder_name = malloc((current_file_len + 1) * sizeof(char));
+            strcpy(folder_name, current_file);
+            folder_name[current_file_len] = '\0';
+
+            SwimdFolderStruct *folder_node = malloc(sizeof(SwimdFolderStruct));
+            folder_node->name = folder_name;
+            folder_node->name_length = current_file_len;
+            folder_node->parent = folder;
+            folder_node->path = NULL;
+
+            swimd_folders_init(&folder_node->folder_lst);
+            swimd_folders_append(&folder->folder_lst, folder_node);
+
+            if (share_dir)
+                swimd_atomic_fetch_add(&dir->refs, 1);
+            swimd_walk_push(worker, (SwimdWalkItem){
+                .parent = share_dir ? dir : NULL,
+                .folder = folder_node,
+                .ignore = ignore,
+                .prefix_length = prefix_length + current_file_len + 1,
+            });
+        } else {
+            char *file_name = malloc((current_file_len + 1) * sizeof(char));
+            strcpy(file_name, current_file);
+            file_name[current_file_len] = '\0';
+
+            SwimdFile file_node = {
+                .name = file_name,
+                .name_length = current_file_len,
+                .folder = folder
+            };
+
+            swimd_file_list_push(&worker->files, file_node);
+            if (walker->stream && worker->files.length - worker->files_streamed >= WALK_STREAM_CHUNK)
+                swimd_walk_stream(worker);
+            long files_count = swimd_atomic_fetch_add(walker->files_count, 1) + 1;
+            if (files_count % 10000 == 0)
+                swimd_log_append(SWIMD_INFO, "Scanned file count %ld", files_count);
+        }
+    }
+}
+
+// Directories without an open parent, or whose open ran out of descriptors,
+// are opened by their path from the walk root.
+static int swimd_walk_open_path(SwimdWalker *walker, SwimdFolderStruct *folder) {
+    char path[MAX_PATH_LENGTH];
+    if (!swimd_folder_relative_path(path, sizeof(path), walker->root_folder, folder->parent, folder->name))
+        return -1;
+    return openat(walker->root->fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+static void swimd_walk_item(SwimdWalkWorker *worker, SwimdWalkItem *item) {
+    SwimdWalker *walker = worker->walker;
+    int fd = -1;
+    int open_errno = EMFILE;
+    if (item->parent != NULL) {
+        fd = openat(item->parent->fd,
+                item->folder->name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        open_errno = errno;
+        swimd_walk_dir_release(walker, item->parent);
+    }
+    if (fd < 0 && (open_errno == EMFILE || open_errno == ENFILE))
+        fd = swimd_walk_open_path(walker, item->folder);
+    if (fd < 0) {
+        swimd_log_append(SWIMD_ERR, "Unable to open directory %s", item->folder->name);
+        return;
+    }
+    SwimdWalkDir *dir = swimd_walk_dir_new(walker, fd);
+    swimd_walk_dir(worker, dir, item->folder, item->ignore, item->prefix_length);
+    swimd_walk_dir_release(walker, dir);
+}
+
+static void* swimd_walk_worker_loop(void *param) {
+    SwimdWalkWorker *worker = param;
+    SwimdWalker *walker = worker->walker;
+    int self = worker - walker->workers;
+    SwimdWalkItem item;
+    while (1) {
+        long seen_pushes = swimd_atomic_fetch_add(&walker->pushes, 0);
+        bool found = swimd_walk_pop(worker, &item);
+        for (int i = 1; !found && i < walker->workers_count; i++) {
+            found = swimd_walk_steal(&walker->workers[(self + i) % walker->workers_count], &item);
+        }
+        if (!found) {
+            if (walker->pending == 0)
+                break;
+            swimd_walk_wait(walker, seen_pushes);
+            continue;
+        }
+        if (!walker->scanner->scan_cancelled)
+            swimd_walk_item(worker, &item);
+        else
+            swimd_walk_dir_release(walker, item.parent);
+        if (swimd_atomic_fetch_add(&walker->pending, -1) == 1) {
+            swimd_crit_lock(&walker->idle_lock);
+            pthread_cond_broadcast(&walker->work_pushed);
+            swimd_crit_unlock(&walker->idle_lock);
+            swimd_are_set(&walker->walk_done);
+        }
+    }
+    return NULL;
+}
+
+// Walks the tree below root_fd, which is released here, on workers_count
+// threads; with one the walk runs on the calling thread. Files are collected per
+// thread and appended to file_list in worker order once every directory is
+// read. Ignore levels loaded on the way end up in the watch when there is one.
+// With stream set, the calling thread hands chunks of the files read so far to
+// the partial snapshot while it waits. With git_worktree set it walks a git
+// work tree for the untracked files, see swimd_git_walk_untracked. Stamps of
+// every directory read and .gitignore loaded are appended to stamps when set.
+static void swimd_walk_tree(SwimdScanner *scanner,
+        int root_fd,
+        SwimdFolderStruct *root_folder,
+        SwimdIgnore *ignore,
+        SwimdFileList *file_list,
+        volatile long *files_count,
+        SwimdWatch *watch,
+        bool stream,
+        bool git_worktree,
+        SwimdWalkStampList *stamps,
+        int workers_count) {
+    SwimdWalker *walker = malloc(sizeof(SwimdWalker));
+    walker->workers_count = workers_count;
+    walker->pending = 0;
+    walker->files_count = files_count;
+    walker->scanner = scanner;
+    walker->watch = watch;
+    walker->stream = stream && workers_count > 1;
+    walker->git_worktree = git_worktree;
+    walker->stamps = stamps;
+    walker->pushes = 0;
+    swimd_crit_init(&walker->idle_lock);
+    pthread_cond_init(&walker->work_pushed, NULL);
+    swimd_are_init(&walker->walk_done, false);
+    swimd_crit_init(&walker->stream_lock);
+    swimd_file_list_init(&walker->stream_files);
+
+    for (int i = 0; i < walker->workers_count; i++) {
+        SwimdWalkWorker *worker = &walker->workers[i];
+        worker->capacity = 64;
+        worker->arr = malloc(worker->capacity * sizeof(SwimdWalkItem));
+        worker->begin = 0;
+        worker->end = 0;
+        worker->walker = walker;
+        worker->dents_capacity = 2 * WALK_DENTS_BUFFER_SIZE;
+        worker->dents = malloc(worker->dents_capacity);
+        worker->ignores = NULL;
+        worker->files_streamed = 0;
+        worker->stamps = (SwimdWalkStampList){0};
+        swimd_crit_init(&worker->lock);
+        swimd_file_list_init(&worker->files);
+    }
+
+    int prefix_length = swimd_folder_prefix_length(root_folder);
+    // a quarter of the descriptor limit, the editor needs the rest
+    struct rlimit files_limit;
+    walker->open_dirs = 0;
+    walker->max_open_dirs = WALK_MAX_OPEN_DIRS;
+    if (getrlimit(RLIMIT_NOFILE, &files_limit) == 0 && files_limit.rlim_cur != RLIM_INFINITY)
+        walker->max_open_dirs = MIN(walker->max_open_dirs, (long)files_limit.rlim_cur / 4 - workers_count);
+    walker->root_folder = root_folder;
+    walker->root = swimd_walk_dir_new(walker, root_fd);
+    swimd_walk_dir(&walker->workers[0], walker->root, root_folder, ignore, prefix_length);
+
+    if (walker->workers_count == 1) {
+        swimd_walk_worker_loop(&walker->workers[0]);
+    } else {
+        for (int i = 0; i < walker->workers_count; i++) {
+            SwimdWalkWorker *worker = &walker->workers[i];
+            swimd_thread_create(&worker->thread, &swimd_walk_worker_loop, worker);
+        }
+        // the interval only bounds how stale the partial snapshot gets
+        while (walker->stream && walker->pending != 0
+                && !swimd_are_wait_timeout(&walker->walk_done, WALK_STREAM_INTERVAL_MS)) {
+            swimd_walk_stream_flush(walker);
+        }
+        for (int i = 0; i < walker->workers_count; i++) {
+            SwimdWalkWorker *worker = &walker->workers[i];
+            swimd_thread_join(&worker->thread);
+            swimd_thread_close(&worker->thread);
+        }
+    }
+    for (int i = 0; i < walker->workers_count; i++) {
+        SwimdWalkWorker *worker = &walker->workers[i];
+        swimd_file_list_append_all(file_list, &worker->files);
+        swimd_file_list_free(&worker->files);
+        for (int k = 0; k < worker->stamps.length; k++) {
+            SwimdWalkStamp *stamp = &worker->stamps.arr[k];
+            swimd_walk_stamp_push(stamps, stamp->folder, stamp->ignore_file, stamp->mtime);
+        }
+        free(worker->stamps.arr);
+        swimd_crit_close(&worker->lock);
+        if (watch != NULL) {
+            for (SwimdIgnore *level = worker->ignores; level != NULL; ) {
+                SwimdIgnore *next = level->next;
+                level->next = watch->ignores;
+                watch->ignores = level;
+                level = next;
+            }
+        } else {
+            swimd_ignore_free(worker->ignores);
+        }
+        free(worker->dents);
+        free(worker->arr);
+    }
+    swimd_walk_dir_release(walker, walker->root);
+    swimd_crit_close(&walker->idle_lock);
+    pthread_cond_destroy(&walker->work_pushed);
+    swimd_are_close(&walker->walk_done);
+    swimd_crit_close(&walker->stream_lock);
+    swimd_file_list_free(&walker->stream_files);
+    free(walker);
+}
+
+// Directory reads are mostly waiting on the file system, so the walk runs on
+// more threads than there are cores.
+static void swimd_list_files_linux(const char *root_dir,
+        SwimdFileList *file_list,
+        SwimdFolderStruct *root_folder,
+        bool refreshing) {
+    SwimdScanner *scanner = &swimd_scanners[SCANNER_FILES];
+    SwimdWatch *watch = swimd_watch_enabled ? swimd_watch_new() : NULL;
+
+    SwimdIgnore *prune = swimd_ignore_new(root_folder, NULL);
+    swimd_crit_lock(&scanner->scan_state_lock);
+    for (int i = 0; i < swimd_prune_list_length; i++) {
+        swimd_ignore_add(prune, swimd_prune_list[i], strlen(swimd_prune_list[i]));
+    }
+    swimd_crit_unlock(&scanner->scan_state_lock);
+
+    int root_fd = open(root_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd >= 0) {
+        swimd_walk_tree(scanner,
+                root_fd,
+                root_folder,
+                prune,
+                file_list,
+                refreshing ? &scanner->scan_files_refresh_count : &scanner->scan_files_count,
+                watch,
+                !refreshing,
+                false,
+                NULL,
+                MIN(MAX(2 * swimd_cpu_count(), 4), MAX_WALK_WORKERS));
+    } else {
+        swimd_log_append(SWIMD_ERR, "Unable to open directory %s", root_dir);
+    }
+
+    if (watch != NULL) {
+        prune->next = watch->ignores;
+        watch->ignores = prune;
+    } else {
+        swimd_ignore_free(prune);
+    }
+    scanner->scan_watch = watch;
+}
+#endif
+
+static void swimd_list_files(const char *root_dir,
+        char *base_path,
         SwimdFileList *file_list,
         SwimdFolderStruct *root_folder,
         bool refreshing) {
@@ -872,6 +2204,7 @@ static SwimdFolderStruct* swimd_process_path(const char *path,
             folder_node->name = folder_name;
             folder_node->name_length = segment_len;
             folder_node->parent = base_folder;
+            folder_node->path = NULL;
 
             swimd_folders_init(&folder_node->folder_lst);
             swimd_folders_append(&base_folder->folder_lst, folder_node);
@@ -886,7 +2219,137 @@ static SwimdFolderStruct* swimd_process_path(const char *path,
     return base_folder;
 }
 
-static void swimd_git_collect_index_paths(git_repository *repo,
+// Reader over a mapped .git/index, versions 2 to 4. Only the paths are decoded,
+// v4 paths are prefix compressed against the previous one so it is kept whole.
+typedef struct {
+    const uint8_t *map;
+    size_t size; // end of entries and extensions, the trailer hash is cut off
+    size_t offset;
+    uint32_t version;
+    uint32_t entries_left;
+    char path[GIT_INDEX_PATH_BUFFER_SIZE];
+    int path_length;
+} SwimdGitIndexReader;
+
+static uint32_t swimd_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t swimd_be16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static bool swimd_git_index_reader_init(SwimdGitIndexReader *reader,
+        const uint8_t *map,
+        size_t size) {
+    if (size < GIT_INDEX_HEADER_SIZE + GIT_OID_SHA1_SIZE || memcmp(map, "DIRC", 4) != 0)
+        return false;
+    reader->map = map;
+    reader->size = size - GIT_OID_SHA1_SIZE;
+    reader->offset = GIT_INDEX_HEADER_SIZE;
+    reader->version = swimd_be32(map + 4);
+    reader->entries_left = swimd_be32(map + 8);
+    reader->path[0] = '\0';
+    reader->path_length = 0;
+    return reader->version >= 2 && reader->version <= 4;
+}
+
+// Decodes the path of the next entry, returns 1 on an entry, 0 past the last
+// one and -1 when the entry is malformed or a sparse directory.
+static int swimd_git_index_next(SwimdGitIndexReader *reader) {
+    if (reader->entries_left == 0)
+        return 0;
+    reader->entries_left--;
+
+    const uint8_t *map = reader->map;
+    size_t size = reader->size;
+    size_t entry = reader->offset;
+    if (size - entry < GIT_INDEX_ENTRY_FIXED_SIZE)
+        return -1;
+    uint32_t mode = swimd_be32(map + entry + 24);
+    if ((mode & 0170000) == 0040000)
+        return -1;
+    uint16_t flags = swimd_be16(map + entry + GIT_INDEX_ENTRY_FIXED_SIZE - 2);
+    size_t path_offset = entry + GIT_INDEX_ENTRY_FIXED_SIZE;
+    if ((flags & GIT_INDEX_ENTRY_EXTENDED) != 0) {
+        if (reader->version < 3 || size - path_offset < 2)
+            return -1;
+        path_offset += 2;
+    }
+
+    int keep_length = 0;
+    if (reader->version == 4) {
+        // bytes to strip from the end of the previous path, git's offset varint
+        size_t strip = 0;
+        while (1) {
+            if (path_offset == size || strip > GIT_INDEX_PATH_BUFFER_SIZE)
+                return -1;
+            uint8_t c = map[path_offset++];
+            strip = (strip << 7) | (c & 0x7f);
+            if ((c & 0x80) == 0)
+                break;
+            strip++;
+        }
+        if (strip > (size_t)reader->path_length)
+            return -1;
+        keep_length = reader->path_length - (int)strip;
+    }
+
+    const uint8_t *suffix = map + path_offset;
+    const uint8_t *nul = memchr(suffix, '\0', size - path_offset);
+    if (nul == NULL)
+        return -1;
+    size_t suffix_length = nul - suffix;
+    if (keep_length + suffix_length >= GIT_INDEX_PATH_BUFFER_SIZE)
+        return -1;
+    memcpy(reader->path + keep_length, suffix, suffix_length);
+    reader->path_length = keep_length + (int)suffix_length;
+    reader->path[reader->path_length] = '\0';
+
+    if (reader->version == 4) {
+        reader->offset = path_offset + suffix_length + 1;
+    } else {
+        // entries are NUL padded to a multiple of 8 bytes
+        size_t entry_length = (path_offset - entry + suffix_length + 8) & ~(size_t)7;
+        if (entry_length > size - entry)
+            return -1;
+        reader->offset = entry + entry_length;
+    }
+    return 1;
+}
+
+// Split and sparse indexes keep entries outside this file, libgit2 reads those.
+static bool swimd_git_index_extensions_supported(SwimdGitIndexReader *reader) {
+    size_t offset = reader->offset;
+    while (reader->size - offset >= 8) {
+        const uint8_t *extension = reader->map + offset;
+        if (memcmp(extension, "link", 4) == 0 || memcmp(extension, "sdir", 4) == 0)
+            return false;
+        uint32_t extension_size = swimd_be32(extension + 4);
+        if (extension_size > reader->size - offset - 8)
+            return false;
+        offset += 8 + extension_size;
+    }
+    return offset == reader->size;
+}
+
+// Walks the whole file once without allocating, so the collecting pass never
+// has to back out of a half read index.
+static bool swimd_git_index_supported(const uint8_t *map, size_t size) {
+    SwimdGitIndexReader *reader = malloc(sizeof(SwimdGitIndexReader));
+    bool supported = swimd_git_index_reader_init(reader, map, size);
+    if (supported) {
+        int next;
+        while ((next = swimd_git_index_next(reader)) == 1) {
+        }
+        supported = next == 0 && swimd_git_index_extensions_supported(reader);
+    }
+    free(reader);
+    return supported;
+}
+
+static void swimd_git_collect_mapped_paths(const uint8_t *map,
+        size_t size,
         SwimdFileList *file_list,
         SwimdFolderStruct *root_folder,
         bool refreshing) {
@@ -894,13 +2357,41 @@ static void swimd_git_collect_index_paths(git_repository *repo,
     if (scanner->scan_cancelled)
         return;
 
-    git_index *index = NULL;
+    SwimdGitIndexReader *reader = malloc(sizeof(SwimdGitIndexReader));
+    swimd_git_index_reader_init(reader, map, size);
 
-	int index_result = git_repository_index(&index, repo);
-    if (index_result < 0) {
-        swimd_log_git2_error("Unable to index git repository", index_result);
-        goto cleanup;
+    SwimdFolderStruct *cur_folder = root_folder;
+    int cur_depth = 0;
+    char cur_path[MAX_PATH_LENGTH] = "";
+
+    while (swimd_git_index_next(reader) == 1) {
+        // too long to be printed, see swimd_folder_prefix
+        if (reader->path_length >= MAX_PATH_LENGTH)
+            continue;
+        int depth = 0;
+        cur_folder = swimd_process_path(reader->path,
+            file_list,
+            cur_folder,
+            cur_path,
+            cur_depth,
+            &depth,
+            refreshing);
+        cur_depth = depth;
+        strcpy(cur_path, reader->path);
+
+        if (scanner->scan_cancelled)
+            break;
     }
+    free(reader);
+}
+
+static void swimd_git_collect_index_paths(git_index *index,
+        SwimdFileList *file_list,
+        SwimdFolderStruct *root_folder,
+        bool refreshing) {
+    SwimdScanner *scanner = &swimd_scanners[SCANNER_GIT];
+    if (scanner->scan_cancelled)
+        return;
 
     size_t entry_count = git_index_entrycount(index);
 
@@ -908,8 +2399,11 @@ static void swimd_git_collect_index_paths(git_repository *repo,
     int cur_depth = 0;
     char cur_path[MAX_PATH_LENGTH] = "";
 
-    for (int i = 0; i < entry_count; i++) {
+    for (size_t i = 0; i < entry_count; i++) {
         const git_index_entry *entry = git_index_get_byindex(index, i);
+        // too long to be printed, see swimd_folder_prefix
+        if (strlen(entry->path) >= MAX_PATH_LENGTH)
+            continue;
         int depth = 0;
         cur_folder = swimd_process_path(entry->path,
             file_list,
@@ -924,18 +2418,81 @@ static void swimd_git_collect_index_paths(git_repository *repo,
         if (scanner->scan_cancelled)
             break;
     }
+}
 
-cleanup:
-	git_index_free(index);
+// Paths relative to the work tree, NUL separated in one buffer.
+typedef struct {
+    char *arr;
+    long length;
+    long capacity;
+    int count;
+} SwimdGitPaths;
+
+static void swimd_git_paths_append(SwimdGitPaths *paths, const char *path) {
+    long path_length = strlen(path) + 1;
+    if (paths->length + path_length > paths->capacity) {
+        paths->capacity = MAX(MAX(paths->capacity * 2, paths->length + path_length), 4096);
+        paths->arr = realloc(paths->arr, paths->capacity);
+    }
+    memcpy(paths->arr + paths->length, path, path_length);
+    paths->length += path_length;
+    paths->count++;
+}
+
+static void swimd_git_paths_free(SwimdGitPaths *paths) {
+    free(paths->arr);
+}
+
+static uint64_t swimd_git_path_hash(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Tells two untracked walks apart without keeping the paths of the last one.
+// The path hashes are summed, so the walk order does not matter.
+static uint64_t swimd_git_paths_hash(SwimdGitPaths *paths) {
+    uint64_t hash = paths->count;
+    for (long pos = 0; pos < paths->length; pos += strlen(paths->arr + pos) + 1) {
+        hash += swimd_git_path_hash(paths->arr + pos);
+    }
+    return hash;
 }
 
-static void swimd_git_collect_status_paths(git_repository *repo,
+static void swimd_git_collect_untracked_paths(SwimdGitPaths *untracked,
         SwimdFileList *file_list,
         SwimdFolderStruct *root_folder,
         bool refreshing) {
     SwimdScanner *scanner = &swimd_scanners[SCANNER_GIT];
     if (scanner->scan_cancelled)
         return;
+
+    SwimdFolderStruct *cur_folder = root_folder;
+    int cur_depth = 0;
+    char cur_path[MAX_PATH_LENGTH] = "";
+
+    for (long pos = 0; pos < untracked->length; pos += strlen(untracked->arr + pos) + 1) {
+        const char *path = untracked->arr + pos;
+        int depth = 0;
+        cur_folder = swimd_process_path(path,
+            file_list,
+            cur_folder,
+            cur_path,
+            cur_depth,
+            &depth,
+            refreshing);
+        cur_depth = depth;
+        strcpy(cur_path, path);
+
+        if (scanner->scan_cancelled)
+            break;
+    }
+}
+
+#ifdef _WIN32
+static void swimd_git_status_untracked(git_repository *repo, SwimdGitPaths *untracked) {
     git_status_options status_opts = GIT_STATUS_OPTIONS_INIT;
     status_opts.show = GIT_STATUS_SHOW_WORKDIR_ONLY;
     status_opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED |
@@ -945,82 +2502,389 @@ static void swimd_git_collect_status_paths(git_repository *repo,
     int list_result = git_status_list_new(&status_list, repo, &status_opts);
     if (list_result < 0) {
         swimd_log_git2_error("Unable to index git repository", list_result);
-        goto cleanup;
+        return;
     }
 
-    SwimdFolderStruct *cur_folder = root_folder;
-    int cur_depth = 0;
-    char cur_path[MAX_PATH_LENGTH] = "";
-
     size_t count = git_status_list_entrycount(status_list);
     for (size_t i = 0; i < count; i++) {
         const git_status_entry *entry = git_status_byindex(status_list, i);
         if (entry->index_to_workdir == NULL) {
             continue;
         }
-        const char *path = entry->index_to_workdir->new_file.path;
-        if ((entry->status & GIT_STATUS_WT_NEW) > 0) {
-            int depth = 0;
-            cur_folder = swimd_process_path(path,
-                file_list,
-                cur_folder,
-                cur_path,
-                cur_depth,
-                &depth,
-                refreshing);
-            cur_depth = depth;
-            strcpy(cur_path, path);
-        }
-        if (scanner->scan_cancelled)
-            break;
+        if ((entry->status & GIT_STATUS_WT_NEW) > 0)
+            swimd_git_paths_append(untracked, entry->index_to_workdir->new_file.path);
     }
-cleanup:
     git_status_list_free(status_list);
 }
+#else
+typedef struct {
+    uint64_t hash;
+    long offset; // into paths, -1 for an empty slot
+} SwimdGitPathSlot;
 
-static void swimd_list_git_normalize_base_path(char *base_path) {
-    if (PATH_SLASH_CHAR == PATH_SLASH_GIT_CHAR)
-        return;
-    int base_path_len = strlen(base_path);
-    for (int i = 0; i < base_path_len; i++) {
-        if (base_path[i] == PATH_SLASH_GIT_CHAR)
-            base_path[i] = PATH_SLASH_CHAR;
+// Open addressing set over the tracked paths of the index.
+typedef struct {
+    SwimdGitPaths paths;
+    SwimdGitPathSlot *slots;
+    long mask;
+} SwimdGitPathSet;
+
+static void swimd_git_path_set_build(SwimdGitPathSet *set) {
+    long capacity = 16;
+    while (capacity < 2 * (long)set->paths.count)
+        capacity *= 2;
+    set->mask = capacity - 1;
+    set->slots = malloc(capacity * sizeof(SwimdGitPathSlot));
+    for (long i = 0; i < capacity; i++) {
+        set->slots[i].offset = -1;
+    }
+    for (long pos = 0; pos < set->paths.length; pos += strlen(set->paths.arr + pos) + 1) {
+        uint64_t hash = swimd_git_path_hash(set->paths.arr + pos);
+        long slot = hash & set->mask;
+        while (set->slots[slot].offset >= 0)
+            slot = (slot + 1) & set->mask;
+        set->slots[slot] = (SwimdGitPathSlot){ .hash = hash, .offset = pos };
     }
-
 }
-static void swimd_list_git(const char *root_dir,
-        char *base_path,
-        SwimdFileList *file_list,
-        SwimdFolderStruct *root_folder,
-        bool refreshing) {
-    git_repository *repo = NULL;
 
-    int repo_result = git_repository_open_ext(&repo, root_dir, 0, NULL);
-    if (repo_result == GIT_ENOTFOUND) {
-        swimd_log_append(SWIMD_INFO, "Not a git repository %s", root_dir);
-        goto cleanup;
-    } else if (repo_result < 0) {
-        swimd_log_git2_error("Unable to open git repository", repo_result);
-        goto cleanup;
+static bool swimd_git_path_set_contains(SwimdGitPathSet *set, const char *path) {
+    uint64_t hash = swimd_git_path_hash(path);
+    for (long slot = hash & set->mask; set->slots[slot].offset >= 0; slot = (slot + 1) & set->mask) {
+        if (set->slots[slot].hash == hash && strcmp(set->paths.arr + set->slots[slot].offset, path) == 0)
+            return true;
     }
+    return false;
+}
 
-    const char *repo_path = git_repository_workdir(repo);
-    int repo_path_length = strlen(repo_path);
-    repo_path_length--; // cut last slash
-    strncpy(base_path, repo_path, repo_path_length);
-    base_path[repo_path_length] = '\0';
-    swimd_list_git_normalize_base_path(base_path);
+static void swimd_git_path_set_free(SwimdGitPathSet *set) {
+    swimd_git_paths_free(&set->paths);
+    free(set->slots);
+}
 
-    swimd_git_collect_index_paths(repo,
-            file_list,
-            root_folder,
-            refreshing);
-    swimd_git_collect_status_paths(repo,
+// What the untracked walk depends on besides the index: every directory it
+// read, the .gitignore files and the excludes files. Paths are relative to the
+// work tree except for the excludes files, a missing file has a zero time.
+typedef struct SwimdGitStamps {
+    SwimdGitPaths paths;
+    struct timespec *mtimes;
+    int capacity;
+} SwimdGitStamps;
+
+static void swimd_git_stamps_append(SwimdGitStamps *stamps, const char *path, struct timespec mtime) {
+    if (stamps->paths.count == stamps->capacity) {
+        stamps->capacity = MAX(stamps->capacity * 2, 64);
+        stamps->mtimes = realloc(stamps->mtimes, stamps->capacity * sizeof(struct timespec));
+    }
+    stamps->mtimes[stamps->paths.count] = mtime;
+    swimd_git_paths_append(&stamps->paths, path);
+}
+
+static struct timespec swimd_git_stamp_stat(int dir_fd, const char *path) {
+    struct stat st;
+    if (fstatat(dir_fd, path, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return (struct timespec){0};
+    return st.st_mtim;
+}
+
+static void swimd_git_stamps_free(SwimdGitStamps *stamps) {
+    if (stamps == NULL)
+        return;
+    swimd_git_paths_free(&stamps->paths);
+    free(stamps->mtimes);
+    free(stamps);
+}
+
+// Only the stamps of a walk whose result is published are kept.
+static void swimd_git_stamps_keep(SwimdScanner *scanner, SwimdGitStamps **stamps) {
+    swimd_git_stamps_free(scanner->git_stamps);
+    scanner->git_stamps = *stamps;
+    *stamps = NULL;
+}
+
+// One stat per directory instead of reading them all again, any entry added,
+// removed or renamed moves the time of its directory.
+static bool swimd_git_stamps_unchanged(SwimdGitStamps *stamps, const char *workdir) {
+    if (stamps == NULL)
+        return false;
+    int root_fd = open(workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+        return false;
+    bool unchanged = true;
+    int i = 0;
+    for (long pos = 0; unchanged && pos < stamps->paths.length; pos += strlen(stamps->paths.arr + pos) + 1) {
+        struct timespec mtime = swimd_git_stamp_stat(root_fd, stamps->paths.arr + pos);
+        unchanged = mtime.tv_sec == stamps->mtimes[i].tv_sec && mtime.tv_nsec == stamps->mtimes[i].tv_nsec;
+        i++;
+    }
+    close(root_fd);
+    return unchanged;
+}
+
+static void swimd_git_tracked_paths(SwimdGitPaths *paths,
+        const uint8_t *index_map,
+        size_t index_size,
+        git_index *index) {
+    if (index_map != NULL) {
+        SwimdGitIndexReader *reader = malloc(sizeof(SwimdGitIndexReader));
+        swimd_git_index_reader_init(reader, index_map, index_size);
+        while (swimd_git_index_next(reader) == 1) {
+            swimd_git_paths_append(paths, reader->path);
+        }
+        free(reader);
+    } else {
+        size_t entry_count = git_index_entrycount(index);
+        for (size_t i = 0; i < entry_count; i++) {
+            swimd_git_paths_append(paths, git_index_get_byindex(index, i)->path);
+        }
+    }
+}
+
+// core.excludesFile and then info/exclude go to the level under every
+// .gitignore of the tree, so later and deeper patterns win like in git.
+static void swimd_git_load_excludes(SwimdIgnore *prune, git_repository *repo, SwimdGitStamps *stamps) {
+    char path[1024] = "";
+    git_config *config = NULL;
+    git_buf excludes_file = GIT_BUF_INIT;
+    if (git_repository_config_snapshot(&config, repo) == 0 &&
+            git_config_get_path(&excludes_file, config, "core.excludesFile") == 0) {
+        snprintf(path, sizeof(path), "%s", excludes_file.ptr);
+    } else if (getenv("XDG_CONFIG_HOME") != NULL && getenv("XDG_CONFIG_HOME")[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/git/ignore", getenv("XDG_CONFIG_HOME"));
+    } else if (getenv("HOME") != NULL) {
+        snprintf(path, sizeof(path), "%s/.config/git/ignore", getenv("HOME"));
+    }
+    git_buf_dispose(&excludes_file);
+    git_config_free(config);
+    if (path[0] != '\0') {
+        swimd_git_stamps_append(stamps, path, swimd_git_stamp_stat(AT_FDCWD, path));
+        swimd_ignore_load(prune, AT_FDCWD, path);
+    }
+
+    snprintf(path, sizeof(path), "%sinfo/exclude", git_repository_path(repo));
+    swimd_git_stamps_append(stamps, path, swimd_git_stamp_stat(AT_FDCWD, path));
+    swimd_ignore_load(prune, AT_FDCWD, path);
+}
+
+// Untracked files are the ones in the work tree that are neither ignored nor
+// in the index. The work tree is read by the parallel walker of the files
+// scanner and only names are compared, nothing is hashed. What the walk read
+// goes to stamps.
+static void swimd_git_walk_untracked(SwimdScanner *scanner,
+        git_repository *repo,
+        SwimdGitPathSet *tracked,
+        SwimdGitPaths *untracked,
+        SwimdGitStamps *stamps) {
+    const char *workdir = git_repository_workdir(repo);
+    int root_fd = open(workdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        swimd_log_append(SWIMD_ERR, "Unable to open directory %s", workdir);
+        return;
+    }
+
+    SwimdFolderStruct *root_folder = malloc(sizeof(SwimdFolderStruct));
+    root_folder->name = NULL;
+    root_folder->name_length = 0;
+    root_folder->parent = NULL;
+    root_folder->path = NULL;
+    swimd_folders_init(&root_folder->folder_lst);
+    SwimdIgnore *prune = swimd_ignore_new(root_folder, NULL);
+    swimd_ignore_add(prune, ".git", 4);
+    swimd_git_load_excludes(prune, repo, stamps);
+
+    SwimdFileList walked;
+    swimd_file_list_init(&walked);
+    SwimdWalkStampList walked_stamps = {0};
+    volatile long walked_count = 0;
+    swimd_walk_tree(scanner,
+            root_fd,
+            root_folder,
+            prune,
+            &walked,
+            &walked_count,
+            NULL,
+            false,
+            true,
+            &walked_stamps,
+            MIN(MAX(2 * swimd_cpu_count(), 4), MAX_WALK_WORKERS));
+
+    char path[MAX_PATH_LENGTH];
+    for (int i = 0; i < walked.length; i++) {
+        SwimdFile *file = &walked.arr[i];
+        if (swimd_folder_relative_path(path, MAX_PATH_LENGTH, root_folder, file->folder, file->name) &&
+                !swimd_git_path_set_contains(tracked, path))
+            swimd_git_paths_append(untracked, path);
+    }
+    for (int i = 0; i < walked_stamps.length; i++) {
+        SwimdWalkStamp *stamp = &walked_stamps.arr[i];
+        bool fits = true;
+        if (stamp->ignore_file)
+            fits = swimd_folder_relative_path(path, MAX_PATH_LENGTH, root_folder, stamp->folder, ".gitignore");
+        else if (IS_ROOT_FOLDER(stamp->folder))
+            strcpy(path, ".");
+        else
+            fits = swimd_folder_relative_path(path, MAX_PATH_LENGTH, root_folder, stamp->folder->parent,
+                    stamp->folder->name);
+        if (fits)
+            swimd_git_stamps_append(stamps, path, stamp->mtime);
+    }
+    free(walked_stamps.arr);
+
+    swimd_list_directories_free(&walked, root_folder);
+    swimd_folders_free(&root_folder->folder_lst);
+    free(root_folder);
+    swimd_file_list_free(&walked);
+    swimd_ignore_free(prune);
+}
+#endif
+
+static void swimd_list_git_normalize_base_path(char *base_path) {
+    if (PATH_SLASH_CHAR == PATH_SLASH_GIT_CHAR)
+        return;
+    int base_path_len = strlen(base_path);
+    for (int i = 0; i < base_path_len; i++) {
+        if (base_path[i] == PATH_SLASH_GIT_CHAR)
+            base_path[i] = PATH_SLASH_CHAR;
+    }
+
+}
+
+// The repository handle outlives a scan. Tracked paths come straight from the
+// mapped .git/index, libgit2 only reads it when the format is not supported
+// here, and then only rereads it from disk when the file changed. When neither
+// the index checksum nor the untracked files moved since the last scan, a
+// refresh keeps the published snapshot. The checksum is the trailer of the
+// index file, and on Linux the stamps of the last walk tell whether the
+// untracked side could have moved before anything is walked.
+static void swimd_list_git(const char *root_dir,
+        char *base_path,
+        SwimdFileList *file_list,
+        SwimdFolderStruct *root_folder,
+        bool refreshing) {
+    SwimdScanner *scanner = &swimd_scanners[SCANNER_GIT];
+    if (scanner->git_repo == NULL) {
+        int repo_result = git_repository_open_ext(&scanner->git_repo, root_dir, 0, NULL);
+        if (repo_result == GIT_ENOTFOUND) {
+            swimd_log_append(SWIMD_INFO, "Not a git repository %s", root_dir);
+            scanner->git_repo = NULL;
+            return;
+        } else if (repo_result < 0) {
+            swimd_log_git2_error("Unable to open git repository", repo_result);
+            scanner->git_repo = NULL;
+            return;
+        }
+    }
+    git_repository *repo = scanner->git_repo;
+    git_index *index = NULL;
+    SwimdGitPaths untracked = {0};
+    git_oid index_checksum;
+    struct SwimdGitStamps *stamps = NULL;
+
+    const char *repo_path = git_repository_workdir(repo);
+    int repo_path_length = strlen(repo_path);
+    repo_path_length--; // cut last slash
+    strncpy(base_path, repo_path, repo_path_length);
+    base_path[repo_path_length] = '\0';
+    swimd_list_git_normalize_base_path(base_path);
+
+    const char *git_dir = git_repository_path(repo);
+    char *index_path = malloc((strlen(git_dir) + 6) * sizeof(char));
+    strcpy(index_path, git_dir);
+    strcat(index_path, "index");
+    size_t index_size = 0;
+    uint8_t *index_map = swimd_file_map(index_path, &index_size);
+    // a repository without an index yet has nothing tracked
+    memset(&index_checksum, 0, sizeof(index_checksum));
+    if (index_map != NULL && index_size >= GIT_OID_SHA1_SIZE)
+        git_oid_fromraw(&index_checksum, index_map + index_size - GIT_OID_SHA1_SIZE);
+    if (index_map != NULL && !swimd_git_index_supported(index_map, index_size)) {
+        swimd_log_append(SWIMD_INFO, "Index %s read through libgit2", index_path);
+        swimd_file_unmap(index_map, index_size);
+        index_map = NULL;
+    }
+    free(index_path);
+
+    bool index_unchanged = refreshing && scanner->git_state_valid &&
+        git_oid_equal(&index_checksum, &scanner->git_index_checksum);
+#ifndef _WIN32
+    if (index_unchanged && swimd_git_stamps_unchanged(scanner->git_stamps, git_repository_workdir(repo))) {
+        scanner->scan_unchanged = true;
+        goto cleanup;
+    }
+#endif
+    if (index_map == NULL) {
+        int index_result = git_repository_index(&index, repo);
+        if (index_result == 0)
+            index_result = git_index_read(index, false);
+        if (index_result < 0) {
+            swimd_log_git2_error("Unable to index git repository", index_result);
+            goto cleanup;
+        }
+    }
+
+#ifdef _WIN32
+    swimd_git_status_untracked(repo, &untracked);
+#else
+    SwimdGitPathSet tracked = {0};
+    swimd_git_tracked_paths(&tracked.paths, index_map, index_size, index);
+    swimd_git_path_set_build(&tracked);
+    stamps = calloc(1, sizeof(SwimdGitStamps));
+    swimd_git_walk_untracked(scanner, repo, &tracked, &untracked, stamps);
+    swimd_git_path_set_free(&tracked);
+#endif
+    if (scanner->scan_cancelled)
+        goto cleanup;
+    uint64_t untracked_hash = swimd_git_paths_hash(&untracked);
+
+    if (index_unchanged && untracked_hash == scanner->git_untracked_hash) {
+        scanner->scan_unchanged = true;
+#ifndef _WIN32
+        swimd_git_stamps_keep(scanner, &stamps);
+#endif
+        goto cleanup;
+    }
+
+    if (index_map != NULL) {
+        swimd_git_collect_mapped_paths(index_map,
+                index_size,
+                file_list,
+                root_folder,
+                refreshing);
+    } else {
+        swimd_git_collect_index_paths(index,
+                file_list,
+                root_folder,
+                refreshing);
+    }
+    swimd_git_collect_untracked_paths(&untracked,
             file_list,
             root_folder,
             refreshing);
+    if (!scanner->scan_cancelled) {
+        scanner->git_index_checksum = index_checksum;
+        scanner->git_untracked_hash = untracked_hash;
+        scanner->git_state_valid = true;
+#ifndef _WIN32
+        swimd_git_stamps_keep(scanner, &stamps);
+#endif
+    }
 cleanup:
-    git_repository_free(repo);
+#ifndef _WIN32
+    swimd_git_stamps_free(stamps);
+#endif
+    swimd_git_paths_free(&untracked);
+    git_index_free(index);
+    if (index_map != NULL)
+        swimd_file_unmap(index_map, index_size);
+}
+
+static void swimd_git_state_free(SwimdScanner *scanner) {
+    git_repository_free(scanner->git_repo);
+    scanner->git_repo = NULL;
+#ifndef _WIN32
+    swimd_git_stamps_free(scanner->git_stamps);
+    scanner->git_stamps = NULL;
+#endif
+    scanner->git_state_valid = false;
 }
 
 static void swimd_list_directories_folders_free(SwimdFolderStruct *root_folder) {
@@ -1029,6 +2893,7 @@ static void swimd_list_directories_folders_free(SwimdFolderStruct *root_folder)
         swimd_list_directories_folders_free(folder);
         swimd_folders_free(&folder->folder_lst);
         free(folder->name);
+        free(folder->path);
         free(folder);
     }
 }
@@ -1041,65 +2906,196 @@ static void swimd_list_directories_free(const SwimdFileList *lst,
     }
 }
 
-static void swimd_prep_files_vec(SwimdScanner *scanner) {
-    SwimdFileList *files = scanner->files;
+// case folded character class bit, distinct for letters and digits
+static uint64_t swimd_char_mask(char c) {
+    unsigned char u = (unsigned char)c;
+    if (u >= 'A' && u <= 'Z')
+        u = u - 'A' + 'a';
+    if (u >= 'a' && u <= 'z')
+        return 1ULL << (u - 'a');
+    if (u >= '0' && u <= '9')
+        return 1ULL << (26 + u - '0');
+    return 1ULL << (36 + u % 28);
+}
+
+static void swimd_prep_files_vec_index(SwimdFileList *files,
+        int *files_vec_index,
+        int files_vec_index_length,
+        SwimdPackMode pack_mode) {
     int files_length = files->length;
-    int files_vec_length = CEIL_DIV(files_length, LANES_COUNT_SHORT);
-    SwimdFileVec *files_vec = malloc(files_vec_length * sizeof(SwimdFileVec));
+    if (pack_mode == SWIMD_PACK_SCAN_ORDER) {
+        for (int i = 0; i < files_length; i++) {
+            files_vec_index[i] = i;
+        }
+    } else {
+        // stable counting sort by name length, so a block only pads to its neighbours
+        int *offsets = malloc((MAX_PATH_LENGTH + 1) * sizeof(int));
+        memset(offsets, 0, (MAX_PATH_LENGTH + 1) * sizeof(int));
+        for (int i = 0; i < files_length; i++) {
+            int bucket = MIN(files->arr[i].name_length, MAX_PATH_LENGTH - 1);
+            offsets[bucket + 1]++;
+        }
+        for (int i = 1; i <= MAX_PATH_LENGTH; i++) {
+            offsets[i] += offsets[i - 1];
+        }
+        for (int i = 0; i < files_length; i++) {
+            int bucket = MIN(files->arr[i].name_length, MAX_PATH_LENGTH - 1);
+            files_vec_index[offsets[bucket]++] = i;
+        }
+        free(offsets);
+    }
+    for (int i = files_length; i < files_vec_index_length; i++) {
+        files_vec_index[i] = -1;
+    }
+}
 
+static double swimd_prep_files_vec_waste(SwimdFileList *files,
+        int *files_vec_index,
+        int files_vec_length) {
+    long long used_cells = 0;
+    long long total_cells = 0;
     for (int i = 0; i < files_vec_length; i++) {
         int max_length = 0;
-        for (int j = 0; j < LANES_COUNT_SHORT; j++) {
-            if (i * LANES_COUNT_SHORT + j >= files_length)
+        for (int j = 0; j < swimd_kernel.lanes; j++) {
+            int file_index = files_vec_index[i * swimd_kernel.lanes + j];
+            if (file_index < 0)
                 break;
-            max_length = MAX(max_length, files->arr[i * LANES_COUNT_SHORT + j].name_length);
+            used_cells += files->arr[file_index].name_length;
+            max_length = MAX(max_length, files->arr[file_index].name_length);
         }
+        total_cells += max_length * swimd_kernel.lanes;
+    }
+    if (total_cells == 0)
+        return 0;
+    return 1 - used_cells / (double)total_cells;
+}
 
-        int file_vec_length = max_length * LANES_COUNT_SHORT;
-        short *file_vec_arr = malloc(file_vec_length * sizeof(short));
-        memset(file_vec_arr, 0, file_vec_length * sizeof(short));
+static void swimd_prep_files_vec_report(SwimdFileList *files,
+        int *files_vec_index,
+        int files_vec_length) {
+    if (!swimd_log_enabled)
+        return;
+    double waste = swimd_prep_files_vec_waste(files, files_vec_index, files_vec_length);
+    if (swimd_pack_mode == SWIMD_PACK_SCAN_ORDER) {
+        swimd_log_append(SWIMD_INFO, "Files vec packed in scan order, padding waste %.1f%%",
+                waste * 100);
+        return;
+    }
 
-        for (int k = 0; k < max_length; k++) {
-            for (int j = 0; j < LANES_COUNT_SHORT; j++) {
-                if (i * LANES_COUNT_SHORT + j >= files_length)
-                    break;
-                SwimdFile file = files->arr[i * LANES_COUNT_SHORT + j];
-                if (k >= file.name_length)
-                    continue;
-                file_vec_arr[k * LANES_COUNT_SHORT + j] = (short)file.name[k];
+    int *scan_order_index = malloc(files_vec_length * swimd_kernel.lanes * sizeof(int));
+    swimd_prep_files_vec_index(files,
+            scan_order_index,
+            files_vec_length * swimd_kernel.lanes,
+            SWIMD_PACK_SCAN_ORDER);
+    double scan_order_waste = swimd_prep_files_vec_waste(files, scan_order_index, files_vec_length);
+    free(scan_order_index);
+
+    swimd_log_append(SWIMD_INFO, "Files vec packed by length, padding waste %.1f%% (scan order %.1f%%)",
+            waste * 100,
+            scan_order_waste * 100);
+}
+
+// All blocks share one aligned arena so a query streams through memory in
+// block order, files_vec entries point into it at 64 byte aligned offsets.
+static void swimd_prep_files_vec(SwimdSnapshot *snapshot) {
+    SwimdFileList *files = snapshot->files;
+    int files_length = files->length;
+    int lanes = swimd_kernel.lanes;
+    int files_vec_length = CEIL_DIV(files_length, lanes);
+    SwimdFileVec *files_vec = malloc(files_vec_length * sizeof(SwimdFileVec));
+    int *files_vec_index = malloc(files_vec_length * lanes * sizeof(int));
+    size_t *rows_offsets = malloc(files_vec_length * sizeof(size_t));
+    size_t *arr_offsets = malloc(files_vec_length * sizeof(size_t));
+
+    swimd_prep_files_vec_index(files,
+            files_vec_index,
+            files_vec_length * lanes,
+            swimd_pack_mode);
+
+    size_t arr_size = 0;
+    size_t rows_size = 0;
+    for (int i = 0; i < files_vec_length; i++) {
+        int *block_index = &files_vec_index[i * lanes];
+        int max_length = 0;
+        int min_length = INT_MAX;
+        uint64_t chars_mask = 0;
+        for (int j = 0; j < lanes; j++) {
+            if (block_index[j] < 0)
+                break;
+            SwimdFile *file = &files->arr[block_index[j]];
+            max_length = MAX(max_length, file->name_length);
+            min_length = MIN(min_length, file->name_length);
+            for (int k = 0; k < file->name_length; k++) {
+                chars_mask |= swimd_char_mask(file->name[k]);
             }
         }
+
+        int file_vec_length = max_length * lanes;
+        arr_offsets[i] = arr_size;
+        arr_size += CEIL_DIV(file_vec_length, SWIMD_ALIGNMENT) * SWIMD_ALIGNMENT;
+        rows_offsets[i] = rows_size;
+        rows_size += CEIL_DIV(ROWS_CACHE_DEPTH * file_vec_length * sizeof(short), SWIMD_ALIGNMENT) *
+            SWIMD_ALIGNMENT;
+
         files_vec[i] = (SwimdFileVec){
-            .arr = file_vec_arr,
             .length = file_vec_length,
+            .rows_level_min = 1,
+            .rows_level_max = 0,
+            .min_length = min_length,
+            .chars_mask = chars_mask,
         };
     }
-    scanner->files_vec = files_vec;
-    scanner->files_vec_length = files_vec_length;
-}
 
-static void swimd_prep_files_vec_free(SwimdScanner *state) {
-    for (int i = 0; i < state->files_vec_length; i++) {
-        SwimdFileVec file_vec = state->files_vec[i];
-        free(file_vec.arr);
-    }
-    free(state->files_vec);
-}
+    size_t arena_size = arr_size + rows_size;
+    uint8_t *arena = swimd_aligned_alloc(arena_size);
+    memset(arena, 0, arr_size);
 
-static void swimd_prep_needle_vec(SwimdScanner *state) {
-    int needle_vec_length = state->needle_length  *LANES_COUNT_SHORT;
-    short *needle_vec = malloc(needle_vec_length * sizeof(short));
-    for (int i = 0; i < state->needle_length; i++) {
-        for (int j = 0; j < LANES_COUNT_SHORT; j++) {
-            needle_vec[i * LANES_COUNT_SHORT + j] = (short)state->needle[i];
+    for (int i = 0; i < files_vec_length; i++) {
+        int *block_index = &files_vec_index[i * lanes];
+        SwimdFileVec *file_vec = &files_vec[i];
+        file_vec->arr = arena + arr_offsets[i];
+        file_vec->rows = (short*)(arena + arr_size + rows_offsets[i]);
+
+        int max_length = file_vec->length / lanes;
+        for (int k = 0; k < max_length; k++) {
+            for (int j = 0; j < lanes; j++) {
+                if (block_index[j] < 0)
+                    break;
+                SwimdFile file = files->arr[block_index[j]];
+                if (k >= file.name_length)
+                    continue;
+                file_vec->arr[k * lanes + j] = (uint8_t)file.name[k];
+            }
         }
     }
-    state->needle_vec = needle_vec;
-    state->needle_vec_length = needle_vec_length;
-}
-
-static void swimd_prep_needle_vec_free(SwimdScanner *state) {
-    free(state->needle_vec);
+    free(arr_offsets);
+    free(rows_offsets);
+    swimd_prep_files_vec_report(files, files_vec_index, files_vec_length);
+
+    snapshot->files_vec = files_vec;
+    snapshot->files_vec_length = files_vec_length;
+    snapshot->files_vec_index = files_vec_index;
+    snapshot->files_vec_arena = arena;
+    snapshot->files_vec_arena_size = arena_size;
+    snapshot->files_vec_arena_length = files_vec_length;
+}
+
+// Block of length cells and its rows cache in one aligned allocation.
+static size_t swimd_file_vec_alloc_size(int length, size_t *rows_offset) {
+    *rows_offset = CEIL_DIV(length, SWIMD_ALIGNMENT) * SWIMD_ALIGNMENT;
+    return *rows_offset +
+        CEIL_DIV(ROWS_CACHE_DEPTH * length * sizeof(short), SWIMD_ALIGNMENT) * SWIMD_ALIGNMENT;
+}
+
+static void swimd_prep_files_vec_free(SwimdSnapshot *snapshot) {
+    for (int i = snapshot->files_vec_arena_length; i < snapshot->files_vec_length; i++) {
+        size_t rows_offset;
+        size_t size = swimd_file_vec_alloc_size(snapshot->files_vec[i].length, &rows_offset);
+        swimd_aligned_free(snapshot->files_vec[i].arr, size);
+    }
+    swimd_aligned_free(snapshot->files_vec_arena, snapshot->files_vec_arena_size);
+    free(snapshot->files_vec);
+    free(snapshot->files_vec_index);
 }
 
 static void swimd_setup_needle(const char *needle, SwimdScanner *scanner) {
@@ -1108,13 +3104,32 @@ static void swimd_setup_needle(const char *needle, SwimdScanner *scanner) {
     strcpy(scanner->needle, needle);
     scanner->needle_length = needle_length;
 
-    swimd_prep_needle_vec(scanner);
+    scanner->needle_chars_mask = malloc(needle_length * sizeof(uint64_t));
+    for (int i = 0; i < needle_length; i++) {
+        scanner->needle_chars_mask[i] = swimd_char_mask(needle[i]);
+    }
 }
 
 static void swimd_setup_needle_free(SwimdScanner *scanner) {
     free(scanner->needle);
+    free(scanner->needle_chars_mask);
+}
+
+static void swimd_rows_setup_needle(SwimdScanner *scanner, SwimdSnapshot *snapshot) {
+    int prefix_length = 0;
+    if (snapshot->rows_needle != NULL) {
+        while (snapshot->rows_needle[prefix_length] != '\0' &&
+                snapshot->rows_needle[prefix_length] == scanner->needle[prefix_length]) {
+            prefix_length++;
+        }
+    }
+    snapshot->rows_prefix_length = prefix_length;
+}
 
-    swimd_prep_needle_vec_free(scanner);
+static void swimd_rows_save_needle(SwimdScanner *scanner, SwimdSnapshot *snapshot) {
+    free(snapshot->rows_needle);
+    snapshot->rows_needle = malloc((scanner->needle_length + 1) * sizeof(char));
+    strcpy(snapshot->rows_needle, scanner->needle);
 }
 
 void swimd_vec_estimate_diagnostic(short *d,
@@ -1156,132 +3171,544 @@ static void swimd_score_minmax(int needle_len,
     *max_score = max;
 }
 
-static inline Vector swimd_simd_filter_az(Vector x) {
-    Vector va = _mm256_set1_epi16('a' - 1);
-    Vector vz = _mm256_set1_epi16('z' + 1);
-    Vector vA = _mm256_set1_epi16('A' - 1);
-    Vector vZ = _mm256_set1_epi16('Z' + 1);
-
-    Vector gea = _mm256_cmpgt_epi16(x, va);
-    Vector lez = _mm256_cmpgt_epi16(vz, x);
-    Vector in_a_z = _mm256_and_si256(gea, lez);
-
-    Vector geA = _mm256_cmpgt_epi16(x, vA);
-    Vector leZ = _mm256_cmpgt_epi16(vZ, x);
-    Vector in_A_Z = _mm256_and_si256(geA, leZ);
+static short swimd_char_inverse_case(char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+        return (short)(c ^ ('a' ^ 'A'));
+    return 0;
+}
 
-    Vector mask = _mm256_or_si256(in_a_z, in_A_Z);
-    return _mm256_and_si256(x, mask);
+static void swimd_scalar_row(short *row,
+        const uint8_t *haystack_vec,
+        int haystack_max_length,
+        short needle_char,
+        short needle_char_inverse,
+        short gap_pen,
+        short diag,
+        short left,
+        const short *gap_distr_fun) {
+    const int lanes = 8;
+    short vdiag[8], vleft[8];
+    for (int k = 0; k < lanes; k++) {
+        vdiag[k] = diag;
+        vleft[k] = left;
+    }
+    for (int j = 1; j <= haystack_max_length; j++) {
+        short gap_pen_j = gap_distr_fun[j - 1];
+        for (int k = 0; k < lanes; k++) {
+            short b = haystack_vec[lanes * (j - 1) + k];
+            short up = row[lanes * (j - 1) + k];
+            short reward = b == needle_char ? MATCH_STRICT_REWARD :
+                b == needle_char_inverse ? MATCH_CASE_INSENSITIVE_REWARD : SUB_PENALTY;
+
+            short o1 = vdiag[k] + reward;
+            short o2 = up + gap_pen;
+            short o3 = vleft[k] + gap_pen_j;
+            short o = MAX(MAX(o1, o2), o3);
+            row[lanes * (j - 1) + k] = o;
+
+            vdiag[k] = up;
+            vleft[k] = o;
+        }
+    }
 }
 
-static inline Vector swimd_simd_az_inverse_case(Vector x) {
-    Vector zero = _mm256_setzero_si256();
-    Vector az = swimd_simd_filter_az(x);
-    Vector mask = _mm256_cmpeq_epi16(az, zero);
-    Vector sign = _mm256_set1_epi16('a' ^ 'A');
-    Vector flipped = _mm256_xor_si256(az, sign);
-    Vector clear = _mm256_andnot_si256(mask, flipped);
-    return clear;
+SWIMD_TARGET("sse4.1")
+static void swimd_sse_row(short *row,
+        const uint8_t *haystack_vec,
+        int haystack_max_length,
+        short needle_char,
+        short needle_char_inverse,
+        short gap_pen,
+        short diag,
+        short left,
+        const short *gap_distr_fun) {
+    const int lanes = 8;
+    __m128i sub_pen = _mm_set1_epi16(SUB_PENALTY);
+    __m128i eq_reward = _mm_set1_epi16(MATCH_STRICT_REWARD);
+    __m128i cis_reward = _mm_set1_epi16(MATCH_CASE_INSENSITIVE_REWARD);
+
+    __m128i gap_pen_i = _mm_set1_epi16(gap_pen);
+    __m128i va = _mm_set1_epi16(needle_char);
+    __m128i vca = _mm_set1_epi16(needle_char_inverse);
+    __m128i vdiag = _mm_set1_epi16(diag);
+    __m128i vleft = _mm_set1_epi16(left);
+    for (int j = 1; j <= haystack_max_length; j++) {
+        __m128i gap_pen_j = _mm_set1_epi16(gap_distr_fun[j - 1]);
+        __m128i vb = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i const*)&haystack_vec[lanes * (j - 1)]));
+        __m128i vup = _mm_load_si128((__m128i const*)&row[lanes * (j - 1)]);
+
+        __m128i strict_eq = _mm_cmpeq_epi16(va, vb);
+        __m128i caseinsensitive_eq = _mm_cmpeq_epi16(vca, vb);
+        __m128i reward = _mm_blendv_epi8(sub_pen, cis_reward, caseinsensitive_eq);
+        reward = _mm_blendv_epi8(reward, eq_reward, strict_eq);
+        __m128i o1 = _mm_add_epi16(reward, vdiag);
+
+        __m128i o2 = _mm_add_epi16(vup, gap_pen_i);
+        __m128i o3 = _mm_add_epi16(vleft, gap_pen_j);
+
+        __m128i o = _mm_max_epi16(o1, o2);
+        o = _mm_max_epi16(o, o3);
+        _mm_store_si128((__m128i*)&row[lanes * (j - 1)], o);
+
+        vdiag = vup;
+        vleft = o;
+    }
 }
 
-static void swimd_simd_haystack_scores(short *d,
-    short *needle_vec,
-    int needle_vec_length,
-    short *haystack_vec,
-    int haystack_vec_length,
-    int haystack_index,
-    short *scores,
-    short *gap_distr_fun,
-    SwimdFileList *files,
-    char *needle
-) {
-    int needle_length = needle_vec_length / LANES_COUNT_SHORT;
-    int haystack_max_length = haystack_vec_length / LANES_COUNT_SHORT;
-
-    Vector sub_pen = _mm256_set1_epi16(SUB_PENALTY);
-    Vector eq_reward = _mm256_set1_epi16(MATCH_STRICT_REWARD);
-    Vector cis_reward = _mm256_set1_epi16(MATCH_CASE_INSENSITIVE_REWARD);
-
-    for (int i = 1; i <= needle_length; i++) {
-        Vector gap_pen_i = _mm256_set1_epi16(gap_distr_fun[i - 1]);
-        Vector va = _mm256_loadu_si256((Vector const*)&needle_vec[LANES_COUNT_SHORT * (i - 1)]);
-        Vector vca = swimd_simd_az_inverse_case(va);
-        for (int j = 1; j <= haystack_max_length; j++) {
-            Vector gap_pen_j = _mm256_set1_epi16(gap_distr_fun[j - 1]);
-            Vector vb = _mm256_loadu_si256((Vector const*)&haystack_vec[LANES_COUNT_SHORT * (j - 1)]);
-            Vector vdiag = _mm256_loadu_si256((Vector const*)&d[
-                    D_IND(i - 1, j - 1)
-            ]);
-            Vector vleft = _mm256_loadu_si256((Vector const*)&d[
-                    D_IND(i, j - 1)
-            ]);
-            Vector vup = _mm256_loadu_si256((Vector const*)&d[
-                    D_IND(i - 1, j)
-            ]);
-
-            Vector strict_eq = _mm256_cmpeq_epi16(va, vb);
-            Vector caseinsensitive_eq = _mm256_cmpeq_epi16(vca, vb);
-            Vector hit_mask = _mm256_or_si256(strict_eq, caseinsensitive_eq);
-            Vector c1 = _mm256_and_si256(eq_reward, strict_eq);
-            Vector c2 = _mm256_and_si256(cis_reward, caseinsensitive_eq);
-            Vector c3 = _mm256_andnot_si256(hit_mask, sub_pen);
-            Vector o1 = _mm256_add_epi16(c1, c2);
+// Two ymm halves per column, so the block layout matches the byte row below.
+SWIMD_TARGET("avx2")
+static void swimd_avx2_row(short *row,
+        const uint8_t *haystack_vec,
+        int haystack_max_length,
+        short needle_char,
+        short needle_char_inverse,
+        short gap_pen,
+        short diag,
+        short left,
+        const short *gap_distr_fun) {
+    const int lanes = 32;
+    __m256i sub_pen = _mm256_set1_epi16(SUB_PENALTY);
+    __m256i eq_reward = _mm256_set1_epi16(MATCH_STRICT_REWARD);
+    __m256i cis_reward = _mm256_set1_epi16(MATCH_CASE_INSENSITIVE_REWARD);
+
+    __m256i gap_pen_i = _mm256_set1_epi16(gap_pen);
+    __m256i va = _mm256_set1_epi16(needle_char);
+    __m256i vca = _mm256_set1_epi16(needle_char_inverse);
+    __m256i vdiag[2] = { _mm256_set1_epi16(diag), _mm256_set1_epi16(diag) };
+    __m256i vleft[2] = { _mm256_set1_epi16(left), _mm256_set1_epi16(left) };
+    for (int j = 1; j <= haystack_max_length; j++) {
+        __m256i gap_pen_j = _mm256_set1_epi16(gap_distr_fun[j - 1]);
+        for (int h = 0; h < 2; h++) {
+            int offset = lanes * (j - 1) + 16 * h;
+            __m256i vb = _mm256_cvtepu8_epi16(_mm_load_si128((__m128i const*)&haystack_vec[offset]));
+            __m256i vup = _mm256_load_si256((__m256i const*)&row[offset]);
+
+            __m256i strict_eq = _mm256_cmpeq_epi16(va, vb);
+            __m256i caseinsensitive_eq = _mm256_cmpeq_epi16(vca, vb);
+            __m256i hit_mask = _mm256_or_si256(strict_eq, caseinsensitive_eq);
+            __m256i c1 = _mm256_and_si256(eq_reward, strict_eq);
+            __m256i c2 = _mm256_and_si256(cis_reward, caseinsensitive_eq);
+            __m256i c3 = _mm256_andnot_si256(hit_mask, sub_pen);
+            __m256i o1 = _mm256_add_epi16(c1, c2);
             o1 = _mm256_add_epi16(o1, c3);
-            o1 = _mm256_add_epi16(o1, vdiag);
+            o1 = _mm256_add_epi16(o1, vdiag[h]);
 
-            Vector o2 = _mm256_add_epi16(vup, gap_pen_i);
-            Vector o3 = _mm256_add_epi16(vleft, gap_pen_j);
+            __m256i o2 = _mm256_add_epi16(vup, gap_pen_i);
+            __m256i o3 = _mm256_add_epi16(vleft[h], gap_pen_j);
 
-            Vector o = _mm256_max_epi16(o1, o2);
+            __m256i o = _mm256_max_epi16(o1, o2);
             o = _mm256_max_epi16(o, o3);
-            _mm256_storeu_si256((Vector*)&d[
-                    D_IND(i, j)
-            ], o);
+            _mm256_store_si256((__m256i*)&row[offset], o);
+
+            vdiag[h] = vup;
+            vleft[h] = o;
         }
     }
-    for (int i = 0; i < LANES_COUNT_SHORT; i++) {
-        int file_index = haystack_index * LANES_COUNT_SHORT + i;
-        if (file_index >= files->length)
-            break;
-        int file_name_length = files->arr[file_index].name_length;
-        scores[file_index] = d[D_IND(needle_length, file_name_length) + i];
-#ifdef DEBUG_PRINT
-        // char *file_name = files->arr[file_index].name;
-        // swimd_vec_estimate_diagnostic(d,
-        //         i,
-        //         needle,
-        //         needle_length,
-        //         file_name,
-        //         file_name_length);
+}
+
+// Byte rows keep d[i][j] - swimd_byte_bias(i, j), the bias being the cost of
+// the pure gap run between the diagonal and the cell. With the rewards and gap
+// penalties above the biased cell stays within [-9 min(i, j), 9 min(i, j) + 6],
+// so levels up to SWIMD_BYTE_LEVELS_MAX fit in 8 bits and only candidates that
+// lose the max can saturate. Deeper levels continue in the 16 bit row.
+static inline short swimd_byte_bias(const short *gap_distr_sum, int i, int j) {
+    return gap_distr_sum[MAX(i, j)] - gap_distr_sum[MIN(i, j)];
+}
+
+// 32 lanes of saturating 8 bit cells, compared straight against the haystack bytes.
+SWIMD_TARGET("avx2")
+static void swimd_avx2_byte_row(signed char *row,
+        const short *row_in,
+        short *row_out,
+        const uint8_t *haystack_vec,
+        int haystack_max_length,
+        int level,
+        short needle_char,
+        short needle_char_inverse,
+        const short *gap_distr_fun,
+        const short *gap_distr_sum) {
+    const int lanes = 32;
+    __m256i sub_pen = _mm256_set1_epi8(SUB_PENALTY);
+    __m256i eq_reward = _mm256_set1_epi8(MATCH_STRICT_REWARD);
+    __m256i cis_reward = _mm256_set1_epi8(MATCH_CASE_INSENSITIVE_REWARD);
+
+    short gap_i = gap_distr_fun[level - 1];
+    __m256i va = _mm256_set1_epi8((char)needle_char);
+    __m256i vca = _mm256_set1_epi8((char)needle_char_inverse);
+    __m256i vdiag = _mm256_setzero_si256();
+    __m256i vleft = _mm256_setzero_si256();
+    // Right of the diagonal the corrections only depend on the column through
+    // the gap penalty, which is constant past the first few positions.
+    short gap_tail = gap_distr_fun[MAX_PATH_LENGTH - 1];
+    __m256i diag_pen_tail = _mm256_set1_epi8((char)-ABS(gap_i - gap_tail));
+    __m256i up_pen_tail = _mm256_set1_epi8((char)(2 * gap_i));
+    for (int j = 1; j <= haystack_max_length; j++) {
+        short gap_j = gap_distr_fun[j - 1];
+        __m256i diag_pen, up_pen, left_pen;
+        if (j > level) {
+            diag_pen = gap_j == gap_tail ? diag_pen_tail : _mm256_set1_epi8((char)-ABS(gap_i - gap_j));
+            up_pen = up_pen_tail;
+            left_pen = _mm256_setzero_si256();
+        } else {
+            diag_pen = _mm256_set1_epi8((char)-ABS(gap_i - gap_j));
+            up_pen = _mm256_set1_epi8((char)(j == level ? 2 * gap_i : 0));
+            left_pen = _mm256_set1_epi8((char)(2 * gap_j));
+        }
+
+        __m256i vb = _mm256_load_si256((__m256i const*)&haystack_vec[lanes * (j - 1)]);
+        __m256i vup;
+        if (row_in != NULL) {
+            __m256i bias = _mm256_set1_epi16(swimd_byte_bias(gap_distr_sum, level - 1, j));
+            __m256i u0 = _mm256_load_si256((__m256i const*)&row_in[lanes * (j - 1)]);
+            __m256i u1 = _mm256_load_si256((__m256i const*)&row_in[lanes * (j - 1) + 16]);
+            u0 = _mm256_sub_epi16(u0, bias);
+            u1 = _mm256_sub_epi16(u1, bias);
+            vup = _mm256_permute4x64_epi64(_mm256_packs_epi16(u0, u1), 0xd8);
+        } else {
+            vup = _mm256_load_si256((__m256i const*)&row[lanes * (j - 1)]);
+        }
+
+        __m256i strict_eq = _mm256_cmpeq_epi8(va, vb);
+        __m256i caseinsensitive_eq = _mm256_cmpeq_epi8(vca, vb);
+        __m256i reward = _mm256_blendv_epi8(sub_pen, cis_reward, caseinsensitive_eq);
+        reward = _mm256_blendv_epi8(reward, eq_reward, strict_eq);
+        __m256i o1 = _mm256_adds_epi8(vdiag, reward);
+        o1 = _mm256_adds_epi8(o1, diag_pen);
+
+        __m256i o2 = _mm256_adds_epi8(vup, up_pen);
+        __m256i o3 = _mm256_adds_epi8(vleft, left_pen);
+
+        __m256i o = _mm256_max_epi8(o1, o2);
+        o = _mm256_max_epi8(o, o3);
+        _mm256_store_si256((__m256i*)&row[lanes * (j - 1)], o);
+        if (row_out != NULL) {
+            __m256i bias = _mm256_set1_epi16(swimd_byte_bias(gap_distr_sum, level, j));
+            __m256i w0 = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(o));
+            __m256i w1 = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(o, 1));
+            _mm256_store_si256((__m256i*)&row_out[lanes * (j - 1)], _mm256_add_epi16(w0, bias));
+            _mm256_store_si256((__m256i*)&row_out[lanes * (j - 1) + 16], _mm256_add_epi16(w1, bias));
+        }
+
+        vdiag = vup;
+        vleft = o;
+    }
+}
+
+SWIMD_TARGET("avx512bw")
+static void swimd_avx512_row(short *row,
+        const uint8_t *haystack_vec,
+        int haystack_max_length,
+        short needle_char,
+        short needle_char_inverse,
+        short gap_pen,
+        short diag,
+        short left,
+        const short *gap_distr_fun) {
+    const int lanes = 32;
+    __m512i sub_pen = _mm512_set1_epi16(SUB_PENALTY);
+    __m512i eq_reward = _mm512_set1_epi16(MATCH_STRICT_REWARD);
+    __m512i cis_reward = _mm512_set1_epi16(MATCH_CASE_INSENSITIVE_REWARD);
+
+    __m512i gap_pen_i = _mm512_set1_epi16(gap_pen);
+    __m512i va = _mm512_set1_epi16(needle_char);
+    __m512i vca = _mm512_set1_epi16(needle_char_inverse);
+    __m512i vdiag = _mm512_set1_epi16(diag);
+    __m512i vleft = _mm512_set1_epi16(left);
+    for (int j = 1; j <= haystack_max_length; j++) {
+        __m512i gap_pen_j = _mm512_set1_epi16(gap_distr_fun[j - 1]);
+        __m512i vb = _mm512_cvtepu8_epi16(_mm256_load_si256((__m256i const*)&haystack_vec[lanes * (j - 1)]));
+        __m512i vup = _mm512_load_si512(&row[lanes * (j - 1)]);
+
+        __mmask32 strict_eq = _mm512_cmpeq_epi16_mask(va, vb);
+        __mmask32 caseinsensitive_eq = _mm512_cmpeq_epi16_mask(vca, vb);
+        __m512i reward = _mm512_mask_blend_epi16(caseinsensitive_eq, sub_pen, cis_reward);
+        reward = _mm512_mask_blend_epi16(strict_eq, reward, eq_reward);
+        __m512i o1 = _mm512_add_epi16(reward, vdiag);
+
+        __m512i o2 = _mm512_add_epi16(vup, gap_pen_i);
+        __m512i o3 = _mm512_add_epi16(vleft, gap_pen_j);
+
+        __m512i o = _mm512_max_epi16(o1, o2);
+        o = _mm512_max_epi16(o, o3);
+        _mm512_store_si512(&row[lanes * (j - 1)], o);
+
+        vdiag = vup;
+        vleft = o;
+    }
+}
+
+#ifdef _MSC_VER
+static bool swimd_cpu_os_saves(unsigned long long state_mask) {
+    int info[4];
+    __cpuid(info, 1);
+    bool os_xsave = (info[2] & (1 << 27)) != 0;
+    return os_xsave && (_xgetbv(0) & state_mask) == state_mask;
+}
 #endif
+
+static bool swimd_cpu_supports_scalar(void) {
+    return true;
+}
+
+static bool swimd_cpu_supports_sse41(void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 19)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+static bool swimd_cpu_supports_avx2(void) {
+#ifdef _MSC_VER
+    // xmm and ymm state
+    if (!swimd_cpu_os_saves(0x6))
+        return false;
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool swimd_cpu_supports_avx512bw(void) {
+#ifdef _MSC_VER
+    // xmm, ymm, opmask, upper zmm and hi16 zmm state
+    if (!swimd_cpu_os_saves(0xe6))
+        return false;
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 30)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512bw");
+#endif
+}
+
+// Fastest first, the scalar row runs anywhere.
+static SwimdKernel swimd_kernels[] = {
+    // A zmm row of 16 bit cells is as fast as the byte row, so no byte row here.
+    { "avx512bw", 32, &swimd_avx512_row, NULL, &swimd_cpu_supports_avx512bw },
+    { "avx2", 32, &swimd_avx2_row, &swimd_avx2_byte_row, &swimd_cpu_supports_avx2 },
+    { "sse4.1", 8, &swimd_sse_row, NULL, &swimd_cpu_supports_sse41 },
+    { "scalar", 8, &swimd_scalar_row, NULL, &swimd_cpu_supports_scalar },
+};
+
+static void swimd_kernel_init(void) {
+    int kernels_count = sizeof(swimd_kernels) / sizeof(swimd_kernels[0]);
+    for (int i = 0; i < kernels_count; i++) {
+        if (swimd_kernels[i].supported()) {
+            swimd_kernel = swimd_kernels[i];
+            break;
+        }
     }
+    swimd_log_append(SWIMD_INFO, "Using %s kernel with %d lanes",
+            swimd_kernel.name,
+            swimd_kernel.lanes);
+}
+
+static void swimd_rows_load(short *row,
+        SwimdFileVec *file_vec,
+        int level) {
+    short *cached_row = &file_vec->rows[(level % ROWS_CACHE_DEPTH) * file_vec->length];
+    memcpy(row, cached_row, file_vec->length * sizeof(short));
+}
+
+static void swimd_rows_store(short *row,
+        SwimdFileVec *file_vec,
+        int level) {
+    short *cached_row = &file_vec->rows[(level % ROWS_CACHE_DEPTH) * file_vec->length];
+    memcpy(cached_row, row, file_vec->length * sizeof(short));
 }
 
+// Rows of the previous needle stay valid up to the common prefix, so the
+// block resumes from the deepest cached level and only computes the rest.
+static int swimd_rows_start_level(SwimdFileVec *file_vec, int prefix_length) {
+    int level = MIN(file_vec->rows_level_max, prefix_length);
+    if (level < file_vec->rows_level_min)
+        return 0;
+    return level;
+}
+
+// Pruned block keeps only the rows that are still prefixes of the new needle.
+static void swimd_rows_skip(SwimdFileVec *file_vec, int prefix_length) {
+    int start_level = swimd_rows_start_level(file_vec, prefix_length);
+    if (start_level == 0) {
+        file_vec->rows_level_min = 1;
+        file_vec->rows_level_max = 0;
+        return;
+    }
+    file_vec->rows_level_max = start_level;
+}
+
+static void swimd_rows_update_levels(SwimdFileVec *file_vec,
+        int start_level,
+        int needle_length) {
+    int level_min = MAX(1, needle_length - ROWS_CACHE_DEPTH + 1);
+    if (start_level > 0)
+        level_min = MAX(level_min, file_vec->rows_level_min);
+    file_vec->rows_level_min = level_min;
+    file_vec->rows_level_max = needle_length;
+}
+
+// Row i of the dp only needs row i - 1, so the block is computed in a single
+// row of (haystack length x lanes) that is updated in place: before the store
+// row[j] still holds the cell above, the diagonal and the left cell are carried
+// in registers. The row stays in L1 no matter how long the needle is.
+static void swimd_simd_haystack_scores(short *row,
+    signed char *byte_row,
+    short *border_row,
+    SwimdScanner *scanner,
+    SwimdSnapshot *snapshot,
+    SwimdFileVec *file_vec,
+    int haystack_index,
+    short *gap_distr_fun,
+    short *gap_distr_sum
+) {
+    int lanes = swimd_kernel.lanes;
+    int needle_length = scanner->needle_length;
+    int haystack_max_length = file_vec->length / lanes;
+
+    int start_level = swimd_rows_start_level(file_vec, snapshot->rows_prefix_length);
+    if (start_level > 0)
+        swimd_rows_load(row, file_vec, start_level);
+
+    int level = start_level;
+    int byte_levels = swimd_kernel.byte_row != NULL
+        ? MIN(needle_length, SWIMD_BYTE_LEVELS_MAX) : 0;
+    if (level < byte_levels) {
+        bool from_row = level > 0;
+        if (!from_row)
+            memset(byte_row, 0, file_vec->length);
+
+        for (level = level + 1; level <= byte_levels; level++) {
+            char needle_char = scanner->needle[level - 1];
+            bool cached = level > needle_length - ROWS_CACHE_DEPTH;
+            swimd_kernel.byte_row(byte_row,
+                    from_row ? row : NULL,
+                    cached || level == byte_levels ? row : NULL,
+                    file_vec->arr,
+                    haystack_max_length,
+                    level,
+                    (unsigned char)needle_char,
+                    swimd_char_inverse_case(needle_char),
+                    gap_distr_fun,
+                    gap_distr_sum);
+            if (cached)
+                swimd_rows_store(row, file_vec, level);
+            from_row = false;
+        }
+        level = byte_levels;
+    } else if (level == 0) {
+        memcpy(row, border_row, file_vec->length * sizeof(short));
+    }
+
+    for (int i = level + 1; i <= needle_length; i++) {
+        char needle_char = scanner->needle[i - 1];
+        swimd_kernel.row(row,
+                file_vec->arr,
+                haystack_max_length,
+                (unsigned char)needle_char,
+                swimd_char_inverse_case(needle_char),
+                gap_distr_fun[i - 1],
+                gap_distr_sum[i - 1],
+                gap_distr_sum[i],
+                gap_distr_fun);
+        if (i > needle_length - ROWS_CACHE_DEPTH)
+            swimd_rows_store(row, file_vec, i);
+    }
+    swimd_rows_update_levels(file_vec, start_level, needle_length);
 
-static void swimd_simd_scores(SwimdScanner *scanner) {
-    for (int i = 0; i < scanner->files_vec_length; i++) {
-        swimd_simd_haystack_scores(
-            scanner->d_vec,
-            scanner->needle_vec,
-            scanner->needle_vec_length,
-            scanner->files_vec[i].arr,
-            scanner->files_vec[i].length,
-            i,
-            scanner->scores,
-            scanner->gap_distr_fun,
-            scanner->files,
-            scanner->needle
-        );
+    for (int i = 0; i < lanes; i++) {
+        int file_index = snapshot->files_vec_index[haystack_index * lanes + i];
+        if (file_index < 0)
+            continue;
+        int file_name_length = snapshot->files->arr[file_index].name_length;
+        snapshot->scores[file_index] = row[lanes * (file_name_length - 1) + i];
     }
 }
 
-static void swimd_scores_init(SwimdScanner *state) {
-    state->scores = malloc(state->files_vec_length * LANES_COUNT_SHORT * sizeof(short));
-    state->scores_length = state->files_vec_length * LANES_COUNT_SHORT;
+static void swimd_scores_init(SwimdSnapshot *snapshot) {
+    snapshot->scores = malloc(snapshot->files_vec_length * swimd_kernel.lanes * sizeof(short));
+    snapshot->scores_length = snapshot->files_vec_length * swimd_kernel.lanes;
+}
+
+static void swimd_scores_free(SwimdSnapshot *snapshot) {
+    free(snapshot->scores);
 }
 
-static void swimd_scores_free(SwimdScanner *state) {
-    free(state->scores);
+// Files appended to the list after it was packed get blocks of their own past
+// the arena, sorted by length among themselves. The watch and the partial
+// snapshot of the initial scan grow this way.
+static void swimd_snapshot_append_blocks(SwimdSnapshot *snapshot, int first_file) {
+    SwimdFileList *files = snapshot->files;
+    int count = files->length - first_file;
+    if (count == 0)
+        return;
+    int lanes = swimd_kernel.lanes;
+    int blocks_count = CEIL_DIV(count, lanes);
+    int files_vec_length = snapshot->files_vec_length + blocks_count;
+    snapshot->files_vec = realloc(snapshot->files_vec, files_vec_length * sizeof(SwimdFileVec));
+    snapshot->files_vec_index = realloc(snapshot->files_vec_index,
+            files_vec_length * lanes * sizeof(int));
+
+    SwimdFileList added = {
+        .arr = &files->arr[first_file],
+        .length = count,
+        .capacity = count,
+    };
+    int *added_index = &snapshot->files_vec_index[snapshot->files_vec_length * lanes];
+    swimd_prep_files_vec_index(&added, added_index, blocks_count * lanes, swimd_pack_mode);
+
+    for (int i = 0; i < blocks_count; i++) {
+        int *block_index = &added_index[i * lanes];
+        int max_length = 0;
+        int min_length = INT_MAX;
+        uint64_t chars_mask = 0;
+        for (int j = 0; j < lanes; j++) {
+            if (block_index[j] < 0)
+                continue;
+            block_index[j] += first_file;
+            SwimdFile *file = &files->arr[block_index[j]];
+            max_length = MAX(max_length, file->name_length);
+            min_length = MIN(min_length, file->name_length);
+            for (int k = 0; k < file->name_length; k++) {
+                chars_mask |= swimd_char_mask(file->name[k]);
+            }
+        }
+
+        int file_vec_length = max_length * lanes;
+        size_t rows_offset;
+        size_t size = swimd_file_vec_alloc_size(file_vec_length, &rows_offset);
+        uint8_t *arr = swimd_aligned_alloc(size);
+        memset(arr, 0, rows_offset);
+        for (int j = 0; j < lanes; j++) {
+            if (block_index[j] < 0)
+                continue;
+            SwimdFile *file = &files->arr[block_index[j]];
+            for (int k = 0; k < file->name_length; k++) {
+                arr[k * lanes + j] = (uint8_t)file->name[k];
+            }
+        }
+        snapshot->files_vec[snapshot->files_vec_length + i] = (SwimdFileVec){
+            .arr = arr,
+            .length = file_vec_length,
+            .rows = (short*)(arr + rows_offset),
+            .rows_level_min = 1,
+            .rows_level_max = 0,
+            .min_length = min_length,
+            .chars_mask = chars_mask,
+        };
+    }
+    snapshot->files_vec_length = files_vec_length;
+
+    free(snapshot->scores);
+    snapshot->scores_length = MAX(files_vec_length * lanes, files->length);
+    snapshot->scores = malloc(snapshot->scores_length * sizeof(short));
 }
 
 static void swimd_scores_heap_init(SwimdScoresHeap *scores_heap, int max_size) {
@@ -1385,18 +3812,78 @@ static void swimd_top_scores_diagnostic(
     nob_sb_free(sb);
 }
 
-static int swimd_top_scores(int n, SwimdScanner *scanner) {
+static short swimd_normalized_score(int needle_length,
+        int name_length,
+        int score,
+        int min_score,
+        int max_score,
+        short *len_diff_error) {
+    short normalized_score = (short)((score - min_score) / (double)(max_score - min_score) * 100);
+    *len_diff_error = ABS(needle_length - name_length) /
+        (double)(MAX(needle_length, name_length)) * LEN_DIFF_ERROR_COST * normalized_score;
+    return normalized_score - *len_diff_error;
+}
+
+// Upper bound of the normalized score over the block. swimd_score_minmax gives
+// the best score for a name length; every needle character absent from the
+// block (beyond the ones that can be gapped when the needle is longer) turns a
+// match into a substitution at best. The normalized score grows with the raw
+// score, so the block is skipped when the bound can't enter the heap.
+static bool swimd_block_can_score(SwimdScanner *scanner,
+        SwimdFileVec *file_vec,
+        long prune_score) {
+    int needle_length = scanner->needle_length;
+    if (needle_length == 0)
+        return true;
+
+    int missing_count = 0;
+    for (int i = 0; i < needle_length; i++) {
+        if ((file_vec->chars_mask & scanner->needle_chars_mask[i]) == 0)
+            missing_count++;
+    }
+
+    int max_length = file_vec->length / swimd_kernel.lanes;
+    for (int length = file_vec->min_length; length <= max_length; length++) {
+        int min_score, max_score;
+        swimd_score_minmax(needle_length,
+                length,
+                scanner->gap_distr_sum,
+                &min_score,
+                &max_score);
+        int unmatched_count = MAX(0, missing_count - MAX(0, needle_length - length));
+        int best_score = max_score - (MATCH_STRICT_REWARD - SUB_PENALTY) * unmatched_count;
+
+        short len_diff_error;
+        short normalized_score = swimd_normalized_score(needle_length,
+                length,
+                best_score,
+                min_score,
+                max_score,
+                &len_diff_error);
+        if (normalized_score >= ERROR_THRESHOLD * 100 && normalized_score > prune_score)
+            return true;
+    }
+    return false;
+}
+
+static int swimd_top_scores_range(SwimdScanner *scanner,
+        SwimdSnapshot *snapshot,
+        SwimdScoresHeap *scores_heap,
+        int begin,
+        int end) {
     int match_count = 0;
-    swimd_scores_heap_init(&scanner->scores_heap, n);
-    for (int i = 0; i < scanner->files->length; i++) {
+    for (int slot = begin; slot < end; slot++) {
+        int i = snapshot->files_vec_index[slot];
+        if (i < 0)
+            continue;
         int min_score, max_score;
-        SwimdFile *file = &scanner->files->arr[i];
+        SwimdFile *file = &snapshot->files->arr[i];
         swimd_score_minmax(scanner->needle_length,
                 file->name_length,
                 scanner->gap_distr_sum,
                 &min_score,
                 &max_score);
-        short score = scanner->scores[i];
+        short score = snapshot->scores[i];
         if (score < min_score || score > max_score) {
             swimd_log_append(SWIMD_ERR, "Score outside of the borders needle '%s' file '%s' score %d min %d max %d",
                     scanner->needle,
@@ -1407,10 +3894,13 @@ static int swimd_top_scores(int n, SwimdScanner *scanner) {
             assert(min_score <= score && score <= max_score);
         }
 
-        short normalized_score = (short)((score - min_score) / (double)(max_score - min_score) * 100);
-        short len_diff_error = ABS(scanner->needle_length - file->name_length) /
-            (double)(MAX(scanner->needle_length, file->name_length)) * LEN_DIFF_ERROR_COST * normalized_score;
-        normalized_score -= len_diff_error;
+        short len_diff_error;
+        short normalized_score = swimd_normalized_score(scanner->needle_length,
+                file->name_length,
+                score,
+                min_score,
+                max_score,
+                &len_diff_error);
 
 #ifdef DEBUG_PRINT
         // swimd_top_scores_diag(min_score,
@@ -1425,17 +3915,12 @@ static int swimd_top_scores(int n, SwimdScanner *scanner) {
             continue;
         }
 
-        swimd_scores_heap_insert(&scanner->scores_heap, (SwimdScoresHeapItem){
+        swimd_scores_heap_insert(scores_heap, (SwimdScoresHeapItem){
                 .score = normalized_score,
                 .index = i
         });
         match_count++;
     }
-    qsort(scanner->scores_heap.arr,
-            scanner->scores_heap.size,
-            sizeof(SwimdScoresHeapItem),
-            swimd_compare_heap_item);
-
     return match_count;
 }
 
@@ -1443,48 +3928,651 @@ static void swimd_init_root_folder(SwimdFolderStruct *root) {
     root->parent = NULL;
     root->name = NULL;
     root->name_length = 0;
+    root->path = NULL;
 }
 
 static void swimd_top_scores_free(SwimdScanner *scanner) {
     swimd_scores_heap_free(&scanner->scores_heap);
 }
 
-static void swimd_scanner_free(SwimdScanner *scanner) {
-    swimd_scores_free(scanner);
-    swimd_prep_files_vec_free(scanner);
-    swimd_list_directories_free(scanner->files,
-            scanner->folders);
-    swimd_folders_free(&scanner->folders->folder_lst);
-    swimd_file_list_free(scanner->files);
+// On disk index of a scan, written by swimd_index_write. Sections follow the
+// header in the order of its offsets, blocks are 64 byte aligned in the file
+// so a mapping of it can be scored in place. Integers are in native byte order.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t lanes;
+    uint32_t pack_mode;
+    uint32_t folders_count;
+    uint32_t files_count;
+    uint32_t blocks_count;
+    uint64_t size;
+    uint64_t scan_path_offset; // into names
+    uint64_t base_path_offset;
+    uint64_t folders_offset;
+    uint64_t files_offset;
+    uint64_t index_offset;
+    uint64_t blocks_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t arena_offset;
+    uint64_t arena_size;
+} SwimdIndexHeader;
+
+// folders come after their parent, the root is the first one
+typedef struct {
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t parent;
+} SwimdIndexFolder;
+
+typedef struct {
+    uint64_t name_offset;
+    uint32_t name_length;
+    uint32_t folder;
+} SwimdIndexFile;
+
+typedef struct {
+    uint64_t arr_offset; // into arena
+    uint32_t length;
+    uint32_t min_length;
+    uint64_t chars_mask;
+} SwimdIndexBlock;
+
+typedef struct {
+    const SwimdFolderStruct *folder;
+    uint32_t id;
+} SwimdIndexFolderId;
+
+static const char swimd_index_magic[8] = { 'S', 'W', 'I', 'M', 'D', 'I', 'D', 'X' };
 
-    free(scanner->files);
-    free(scanner->folders);
-    free(scanner->base_path);
+// One index per scanner and scan path, NULL when no index dir is set.
+static char* swimd_index_path(SwimdScanner *scanner, const char *root_path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = root_path; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    char *path = NULL;
+    swimd_crit_lock(&scanner->scan_state_lock);
+    if (swimd_index_dir != NULL) {
+        int length = strlen(swimd_index_dir) + 32;
+        path = malloc(length * sizeof(char));
+        snprintf(path, length, "%s%c%016llx-%d.idx",
+                swimd_index_dir,
+                PATH_SLASH_CHAR,
+                (unsigned long long)hash,
+                (int)(scanner - swimd_scanners));
+    }
+    swimd_crit_unlock(&scanner->scan_state_lock);
+    return path;
 }
 
-static void swimd_scanner_init(const char *root_path, SwimdScanner *scanner) {
-    swimd_log_append(SWIMD_INFO, "Scanning path started %s", root_path);
+static int swimd_index_compare_folder_id(const void *a, const void *b) {
+    const SwimdFolderStruct *fa = ((const SwimdIndexFolderId*)a)->folder;
+    const SwimdFolderStruct *fb = ((const SwimdIndexFolderId*)b)->folder;
+    return fa < fb ? -1 : fa > fb;
+}
+
+static uint32_t swimd_index_folder_id(SwimdIndexFolderId *ids,
+        int folders_count,
+        const SwimdFolderStruct *folder) {
+    SwimdIndexFolderId key = { .folder = folder };
+    SwimdIndexFolderId *found = bsearch(&key, ids, folders_count, sizeof(SwimdIndexFolderId),
+            swimd_index_compare_folder_id);
+    return found != NULL ? found->id : 0;
+}
+
+static uint64_t swimd_index_align(uint64_t offset, uint64_t alignment) {
+    return CEIL_DIV(offset, alignment) * alignment;
+}
+
+static void swimd_index_write_padding(FILE *f, uint64_t from, uint64_t to) {
+    static const char zeros[SWIMD_ALIGNMENT] = {0};
+    fwrite(zeros, 1, to - from, f);
+}
+
+// Runs on the scanner thread after a complete scan. The file is written next
+// to the old one under a name of its own and renamed over it, so a reader maps
+// either whole and editors sharing the index dir don't write into each other's.
+static void swimd_index_write(SwimdScanner *scanner, SwimdSnapshot *snapshot) {
+    char *path = swimd_index_path(scanner, snapshot->scan_path);
+    if (path == NULL)
+        return;
+    SwimdFileList *files = snapshot->files;
+    int lanes = swimd_kernel.lanes;
+
+    // breadth first, so a folder is always listed after its parent
+    int folders_count = 1;
+    int folders_capacity = 64;
+    SwimdFolderStruct **folders = malloc(folders_capacity * sizeof(SwimdFolderStruct*));
+    folders[0] = snapshot->folders;
+    for (int i = 0; i < folders_count; i++) {
+        SwimdFolderStructList *children = &folders[i]->folder_lst;
+        if (folders_count + children->length > folders_capacity) {
+            folders_capacity = MAX(folders_capacity * 2, folders_count + children->length);
+            folders = realloc(folders, folders_capacity * sizeof(SwimdFolderStruct*));
+        }
+        memcpy(&folders[folders_count], children->arr, children->length * sizeof(SwimdFolderStruct*));
+        folders_count += children->length;
+    }
+    SwimdIndexFolderId *ids = malloc(folders_count * sizeof(SwimdIndexFolderId));
+    for (int i = 0; i < folders_count; i++) {
+        ids[i] = (SwimdIndexFolderId){ .folder = folders[i], .id = i };
+    }
+    qsort(ids, folders_count, sizeof(SwimdIndexFolderId), swimd_index_compare_folder_id);
+
+    SwimdIndexHeader header = {0};
+    memcpy(header.magic, swimd_index_magic, sizeof(header.magic));
+    header.version = SWIMD_INDEX_VERSION;
+    header.lanes = lanes;
+    header.pack_mode = swimd_pack_mode;
+    header.folders_count = folders_count;
+    header.files_count = files->length;
+    header.blocks_count = snapshot->files_vec_length;
+
+    uint64_t names_size = 0;
+    header.scan_path_offset = names_size;
+    names_size += strlen(snapshot->scan_path) + 1;
+    header.base_path_offset = names_size;
+    names_size += strlen(snapshot->base_path) + 1;
+    for (int i = 0; i < folders_count; i++) {
+        names_size += folders[i]->name_length + 1;
+    }
+    for (int i = 0; i < files->length; i++) {
+        names_size += files->arr[i].name_length + 1;
+    }
+    uint64_t arena_size = 0;
+    for (int i = 0; i < snapshot->files_vec_length; i++) {
+        arena_size += swimd_index_align(snapshot->files_vec[i].length, SWIMD_ALIGNMENT);
+    }
+
+    header.folders_offset = sizeof(SwimdIndexHeader);
+    header.files_offset = header.folders_offset + folders_count * sizeof(SwimdIndexFolder);
+    header.index_offset = header.files_offset + files->length * sizeof(SwimdIndexFile);
+    header.blocks_offset = swimd_index_align(header.index_offset +
+            (uint64_t)snapshot->files_vec_length * lanes * sizeof(int32_t), sizeof(uint64_t));
+    header.names_offset = header.blocks_offset + snapshot->files_vec_length * sizeof(SwimdIndexBlock);
+    header.names_size = names_size;
+    header.arena_offset = swimd_index_align(header.names_offset + names_size, SWIMD_ALIGNMENT);
+    header.arena_size = arena_size;
+    header.size = header.arena_offset + arena_size;
+
+    char *tmp_path = NULL;
+    FILE *f = swimd_file_create_temp(path, &tmp_path);
+    if (f == NULL) {
+        swimd_log_append(SWIMD_WARN, "Unable to write index %s", tmp_path);
+        goto cleanup;
+    }
+
+    fwrite(&header, sizeof(SwimdIndexHeader), 1, f);
+    uint64_t name_offset = header.base_path_offset + strlen(snapshot->base_path) + 1;
+    for (int i = 0; i < folders_count; i++) {
+        SwimdIndexFolder record = {
+            .name_offset = name_offset,
+            .name_length = folders[i]->name_length,
+            .parent = i == 0 ? 0 : swimd_index_folder_id(ids, folders_count, folders[i]->parent),
+        };
+        fwrite(&record, sizeof(SwimdIndexFolder), 1, f);
+        name_offset += folders[i]->name_length + 1;
+    }
+    for (int i = 0; i < files->length; i++) {
+        SwimdIndexFile record = {
+            .name_offset = name_offset,
+            .name_length = files->arr[i].name_length,
+            .folder = swimd_index_folder_id(ids, folders_count, files->arr[i].folder),
+        };
+        fwrite(&record, sizeof(SwimdIndexFile), 1, f);
+        name_offset += files->arr[i].name_length + 1;
+    }
+    for (int i = 0; i < snapshot->files_vec_length * lanes; i++) {
+        int32_t file_index = snapshot->files_vec_index[i];
+        fwrite(&file_index, sizeof(int32_t), 1, f);
+    }
+    swimd_index_write_padding(f,
+            header.index_offset + (uint64_t)snapshot->files_vec_length * lanes * sizeof(int32_t),
+            header.blocks_offset);
+    uint64_t arr_offset = 0;
+    for (int i = 0; i < snapshot->files_vec_length; i++) {
+        SwimdFileVec *file_vec = &snapshot->files_vec[i];
+        SwimdIndexBlock record = {
+            .arr_offset = arr_offset,
+            .length = file_vec->length,
+            .min_length = file_vec->min_length,
+            .chars_mask = file_vec->chars_mask,
+        };
+        fwrite(&record, sizeof(SwimdIndexBlock), 1, f);
+        arr_offset += swimd_index_align(file_vec->length, SWIMD_ALIGNMENT);
+    }
+
+    fwrite(snapshot->scan_path, 1, strlen(snapshot->scan_path) + 1, f);
+    fwrite(snapshot->base_path, 1, strlen(snapshot->base_path) + 1, f);
+    for (int i = 0; i < folders_count; i++) {
+        fwrite(folders[i]->name, 1, folders[i]->name_length, f);
+        fputc('\0', f);
+    }
+    for (int i = 0; i < files->length; i++) {
+        fwrite(files->arr[i].name, 1, files->arr[i].name_length, f);
+        fputc('\0', f);
+    }
+    swimd_index_write_padding(f, header.names_offset + names_size, header.arena_offset);
+    for (int i = 0; i < snapshot->files_vec_length; i++) {
+        SwimdFileVec *file_vec = &snapshot->files_vec[i];
+        fwrite(file_vec->arr, 1, file_vec->length, f);
+        swimd_index_write_padding(f,
+                file_vec->length,
+                swimd_index_align(file_vec->length, SWIMD_ALIGNMENT));
+    }
 
-    SwimdFileList *files = malloc(sizeof(SwimdFileList));
-    SwimdFolderStruct *folders = malloc(sizeof(SwimdFolderStruct));
-    char *base_path = malloc(MAX_PATH_LENGTH * sizeof(char));
-    swimd_init_root_folder(folders);
+    bool failed = ferror(f) != 0;
+    failed |= fclose(f) != 0;
+    if (failed || !swimd_file_replace(tmp_path, path)) {
+        swimd_log_append(SWIMD_WARN, "Unable to write index %s", path);
+        remove(tmp_path);
+        goto cleanup;
+    }
+    swimd_log_append(SWIMD_INFO, "Index written %s, %d files", path, files->length);
 
-    swimd_file_list_init(files);
-    swimd_folders_init(&folders->folder_lst);
+cleanup:
+    free(tmp_path);
+    free(ids);
+    free(folders);
+    free(path);
+}
+
+static bool swimd_index_section_fits(uint64_t offset, uint64_t count, uint64_t item_size, uint64_t size) {
+    return offset <= size && count <= (size - offset) / item_size;
+}
+
+// Names are NUL terminated in the file, the loader hands them out as strings.
+static bool swimd_index_name_fits(const SwimdIndexHeader *header,
+        const char *names,
+        uint64_t offset,
+        uint32_t length) {
+    return length < MAX_PATH_LENGTH && offset < header->names_size &&
+        length < header->names_size - offset && names[offset + length] == '\0';
+}
+
+// Everything the loader dereferences is bounds checked, a damaged or foreign
+// file is dropped rather than trusted. Like in a scan every path has to fit in
+// MAX_PATH_LENGTH to be printed.
+static bool swimd_index_check(const uint8_t *map, size_t size, const char *root_path) {
+    const SwimdIndexHeader *header = (const SwimdIndexHeader*)map;
+    if (size < sizeof(SwimdIndexHeader) ||
+            memcmp(header->magic, swimd_index_magic, sizeof(header->magic)) != 0 ||
+            header->version != SWIMD_INDEX_VERSION ||
+            header->size != size ||
+            header->folders_count == 0)
+        return false;
+    if (!swimd_index_section_fits(header->folders_offset, header->folders_count, sizeof(SwimdIndexFolder), size) ||
+            !swimd_index_section_fits(header->files_offset, header->files_count, sizeof(SwimdIndexFile), size) ||
+            !swimd_index_section_fits(header->names_offset, header->names_size, 1, size) ||
+            header->names_size == 0)
+        return false;
+
+    const char *names = (const char*)map + header->names_offset;
+    if (names[header->names_size - 1] != '\0' ||
+            header->scan_path_offset >= header->names_size ||
+            header->base_path_offset >= header->names_size ||
+            strcmp(names + header->scan_path_offset, root_path) != 0)
+        return false;
+
+    const SwimdIndexFolder *folders = (const SwimdIndexFolder*)(map + header->folders_offset);
+    int *prefix_lengths = malloc(header->folders_count * sizeof(int));
+    bool valid = true;
+    for (uint32_t i = 0; valid && i < header->folders_count; i++) {
+        if (!swimd_index_name_fits(header, names, folders[i].name_offset, folders[i].name_length) ||
+                (i > 0 && folders[i].parent >= i)) {
+            valid = false;
+            break;
+        }
+        prefix_lengths[i] = i == 0 ? 0 :
+            prefix_lengths[folders[i].parent] + folders[i].name_length + 1;
+        valid = prefix_lengths[i] < MAX_PATH_LENGTH;
+    }
+    const SwimdIndexFile *files = (const SwimdIndexFile*)(map + header->files_offset);
+    for (uint32_t i = 0; valid && i < header->files_count; i++) {
+        valid = swimd_index_name_fits(header, names, files[i].name_offset, files[i].name_length) &&
+            files[i].name_length > 0 &&
+            files[i].folder < header->folders_count &&
+            prefix_lengths[files[i].folder] + files[i].name_length < MAX_PATH_LENGTH;
+    }
+    free(prefix_lengths);
+    return valid;
+}
+
+// Blocks are only reused when they were packed for the running kernel.
+static bool swimd_index_check_blocks(const uint8_t *map, size_t size) {
+    const SwimdIndexHeader *header = (const SwimdIndexHeader*)map;
+    uint32_t lanes = swimd_kernel.lanes;
+    if (header->lanes != lanes ||
+            header->pack_mode != (uint32_t)swimd_pack_mode ||
+            header->blocks_count != CEIL_DIV(header->files_count, lanes))
+        return false;
+    if (!swimd_index_section_fits(header->index_offset, (uint64_t)header->blocks_count * lanes, sizeof(int32_t), size) ||
+            !swimd_index_section_fits(header->blocks_offset, header->blocks_count, sizeof(SwimdIndexBlock), size) ||
+            !swimd_index_section_fits(header->arena_offset, header->arena_size, 1, size) ||
+            header->arena_offset % SWIMD_ALIGNMENT != 0)
+        return false;
+
+    const int32_t *index = (const int32_t*)(map + header->index_offset);
+    for (uint64_t i = 0; i < (uint64_t)header->blocks_count * lanes; i++) {
+        if (index[i] < -1 || index[i] >= (int64_t)header->files_count)
+            return false;
+    }
+    // the kernels read the last row of each name, so it has to fit its block
+    const SwimdIndexFile *files = (const SwimdIndexFile*)(map + header->files_offset);
+    const SwimdIndexBlock *blocks = (const SwimdIndexBlock*)(map + header->blocks_offset);
+    for (uint32_t i = 0; i < header->blocks_count; i++) {
+        if (blocks[i].length % lanes != 0 ||
+                blocks[i].length / lanes > MAX_PATH_LENGTH ||
+                blocks[i].arr_offset % SWIMD_ALIGNMENT != 0 ||
+                !swimd_index_section_fits(blocks[i].arr_offset, blocks[i].length, 1, header->arena_size))
+            return false;
+        for (uint32_t k = 0; k < lanes; k++) {
+            int32_t file_index = index[(uint64_t)i * lanes + k];
+            if (file_index >= 0 && (files[file_index].name_length == 0 ||
+                    files[file_index].name_length > blocks[i].length / lanes))
+                return false;
+        }
+    }
+    return true;
+}
 
-    scanner->scanning_func(root_path, base_path, files, folders, false);
+// Points the blocks at the mapping, only their rows caches are allocated.
+static void swimd_index_map_blocks(SwimdSnapshot *snapshot) {
+    const uint8_t *map = snapshot->index_map;
+    const SwimdIndexHeader *header = (const SwimdIndexHeader*)map;
+    const SwimdIndexBlock *blocks = (const SwimdIndexBlock*)(map + header->blocks_offset);
+    int lanes = swimd_kernel.lanes;
+    int files_vec_length = header->blocks_count;
 
-    swimd_crit_lock(&scanner->scan_state_swap);
+    SwimdFileVec *files_vec = malloc(files_vec_length * sizeof(SwimdFileVec));
+    int *files_vec_index = malloc(files_vec_length * lanes * sizeof(int));
+    memcpy(files_vec_index, map + header->index_offset, files_vec_length * lanes * sizeof(int32_t));
 
-    scanner->files = files;
-    scanner->folders = folders;
-    scanner->base_path = base_path;
+    size_t rows_size = 0;
+    for (int i = 0; i < files_vec_length; i++) {
+        rows_size += CEIL_DIV(ROWS_CACHE_DEPTH * blocks[i].length * sizeof(short), SWIMD_ALIGNMENT) *
+            SWIMD_ALIGNMENT;
+    }
+    uint8_t *arena = swimd_aligned_alloc(rows_size);
+
+    size_t rows_offset = 0;
+    for (int i = 0; i < files_vec_length; i++) {
+        files_vec[i] = (SwimdFileVec){
+            .arr = (uint8_t*)map + header->arena_offset + blocks[i].arr_offset,
+            .length = blocks[i].length,
+            .rows = (short*)(arena + rows_offset),
+            .rows_level_min = 1,
+            .rows_level_max = 0,
+            .min_length = blocks[i].min_length,
+            .chars_mask = blocks[i].chars_mask,
+        };
+        rows_offset += CEIL_DIV(ROWS_CACHE_DEPTH * blocks[i].length * sizeof(short), SWIMD_ALIGNMENT) *
+            SWIMD_ALIGNMENT;
+    }
+
+    snapshot->files_vec = files_vec;
+    snapshot->files_vec_length = files_vec_length;
+    snapshot->files_vec_index = files_vec_index;
+    snapshot->files_vec_arena = arena;
+    snapshot->files_vec_arena_size = rows_size;
+    snapshot->files_vec_arena_length = files_vec_length;
+}
+
+// Maps the index of the last scan of root_path into a snapshot that answers
+// queries while the new scan runs. Names point into the mapping, the folders
+// live in one array with the root first.
+static SwimdSnapshot* swimd_index_load(SwimdScanner *scanner, const char *root_path) {
+    char *path = swimd_index_path(scanner, root_path);
+    if (path == NULL)
+        return NULL;
+    size_t size = 0;
+    uint8_t *map = swimd_file_map(path, &size);
+    if (map == NULL) {
+        free(path);
+        return NULL;
+    }
+    if (!swimd_index_check(map, size, root_path)) {
+        swimd_log_append(SWIMD_WARN, "Index %s does not match, ignored", path);
+        swimd_file_unmap(map, size);
+        free(path);
+        return NULL;
+    }
 
-    swimd_prep_files_vec(scanner);
-    swimd_scores_init(scanner);
+    const SwimdIndexHeader *header = (const SwimdIndexHeader*)map;
+    const char *names = (const char*)map + header->names_offset;
+    SwimdSnapshot *snapshot = calloc(1, sizeof(SwimdSnapshot));
+    snapshot->refs = 1;
+    snapshot->cached = true;
+    snapshot->index_map = map;
+    snapshot->index_map_size = size;
+    const char *base_path = names + header->base_path_offset;
+    snapshot->scan_path = malloc((strlen(root_path) + 1) * sizeof(char));
+    strcpy(snapshot->scan_path, root_path);
+    snapshot->base_path = malloc(MAX(strlen(base_path) + 1, MAX_PATH_LENGTH) * sizeof(char));
+    strcpy(snapshot->base_path, base_path);
+
+    const SwimdIndexFolder *folder_records = (const SwimdIndexFolder*)(map + header->folders_offset);
+    SwimdFolderStruct *folders = malloc(header->folders_count * sizeof(SwimdFolderStruct));
+    for (uint32_t i = 0; i < header->folders_count; i++) {
+        SwimdFolderStruct *folder = &folders[i];
+        folder->name = (char*)names + folder_records[i].name_offset;
+        folder->name_length = folder_records[i].name_length;
+        folder->parent = i == 0 ? NULL : &folders[folder_records[i].parent];
+        folder->path = NULL;
+        swimd_folders_init(&folder->folder_lst);
+        if (folder->parent != NULL)
+            swimd_folders_append(&folder->parent->folder_lst, folder);
+    }
+    snapshot->folders = folders;
+
+    const SwimdIndexFile *file_records = (const SwimdIndexFile*)(map + header->files_offset);
+    snapshot->files = malloc(sizeof(SwimdFileList));
+    snapshot->files->length = header->files_count;
+    snapshot->files->capacity = MAX(header->files_count, 1);
+    snapshot->files->arr = malloc(snapshot->files->capacity * sizeof(SwimdFile));
+    for (uint32_t i = 0; i < header->files_count; i++) {
+        snapshot->files->arr[i] = (SwimdFile){
+            .name = (char*)names + file_records[i].name_offset,
+            .name_length = file_records[i].name_length,
+            .folder = &folders[file_records[i].folder],
+        };
+    }
 
-    swimd_crit_unlock(&scanner->scan_state_swap);
+    if (swimd_index_check_blocks(map, size)) {
+        swimd_index_map_blocks(snapshot);
+    } else {
+        swimd_log_append(SWIMD_INFO, "Index %s packed for another kernel, repacking", path);
+        swimd_prep_files_vec(snapshot);
+    }
+    swimd_scores_init(snapshot);
+
+    swimd_log_append(SWIMD_INFO, "Index loaded %s, %d files", path, snapshot->files->length);
+    free(path);
+    return snapshot;
+}
+
+static void swimd_index_folders_free(SwimdSnapshot *snapshot) {
+    const SwimdIndexHeader *header = snapshot->index_map;
+    for (uint32_t i = 0; i < header->folders_count; i++) {
+        swimd_folders_free(&snapshot->folders[i].folder_lst);
+        free(snapshot->folders[i].path);
+    }
+}
+
+static void swimd_snapshot_release(SwimdSnapshot *snapshot);
+
+// A snapshot with a tree owner, or a partial one without folders, only owns
+// its arrays.
+static void swimd_snapshot_free(SwimdSnapshot *snapshot) {
+    if (snapshot == NULL)
+        return;
+    bool owns_tree = snapshot->tree_owner == NULL;
+#ifndef _WIN32
+    if (owns_tree)
+        swimd_watch_free(snapshot->watch);
+#endif
+    swimd_scores_free(snapshot);
+    swimd_prep_files_vec_free(snapshot);
+    if (snapshot->index_map != NULL) {
+        swimd_index_folders_free(snapshot);
+    } else if (owns_tree && snapshot->folders != NULL) {
+        swimd_list_directories_free(snapshot->files,
+                snapshot->folders);
+        swimd_folders_free(&snapshot->folders->folder_lst);
+        free(snapshot->folders->path);
+    }
+    swimd_file_list_free(snapshot->files);
+
+    free(snapshot->files);
+    if (owns_tree)
+        free(snapshot->folders);
+    free(snapshot->base_path);
+    free(snapshot->scan_path);
+    free(snapshot->rows_needle);
+    if (snapshot->index_map != NULL)
+        swimd_file_unmap(snapshot->index_map, snapshot->index_map_size);
+    swimd_snapshot_release(snapshot->tree_owner);
+    free(snapshot);
+}
+
+// The reference is taken under the same lock the publisher swaps the pointer
+// with, so the snapshot can't be freed between the load and the increment.
+static SwimdSnapshot* swimd_snapshot_acquire(SwimdScanner *scanner) {
+    swimd_crit_lock(&scanner->snapshot_lock);
+    SwimdSnapshot *snapshot = scanner->snapshot;
+    if (snapshot != NULL)
+        swimd_atomic_fetch_add(&snapshot->refs, 1);
+    swimd_crit_unlock(&scanner->snapshot_lock);
+    return snapshot;
+}
+
+static void swimd_snapshot_release(SwimdSnapshot *snapshot) {
+    if (snapshot != NULL && swimd_atomic_fetch_add(&snapshot->refs, -1) == 1)
+        swimd_snapshot_free(snapshot);
+}
+
+// One counter for all scanners, a generation is never handed out twice.
+static volatile long swimd_snapshot_generations = 0;
+
+// Rows of earlier queries only print from a snapshot with their generation.
+static void swimd_snapshot_stamp(SwimdSnapshot *snapshot) {
+    snapshot->generation = swimd_atomic_fetch_add(&swimd_snapshot_generations, 1) + 1;
+}
+
+// Takes the state lock for a snapshot acquired before it. The watch edits the
+// tree of the current snapshot in place, so one that borrows it from a newer
+// snapshot may no longer match it and the current one is used instead.
+static SwimdSnapshot* swimd_snapshot_lock(SwimdScanner *scanner, SwimdSnapshot *snapshot) {
+    swimd_crit_lock(&scanner->scan_state_lock);
+    while (snapshot != NULL && snapshot->tree_owner != NULL && snapshot != scanner->snapshot) {
+        swimd_snapshot_release(snapshot);
+        snapshot = swimd_snapshot_acquire(scanner);
+    }
+    return snapshot;
+}
+
+// Queries keep running on whichever snapshot they acquired, the last of them
+// to release the old one frees it.
+static void swimd_snapshot_publish(SwimdScanner *scanner, SwimdSnapshot *snapshot) {
+    if (snapshot != NULL)
+        swimd_snapshot_stamp(snapshot);
+    swimd_crit_lock(&scanner->snapshot_lock);
+    SwimdSnapshot *old = scanner->snapshot;
+    scanner->snapshot = snapshot;
+    swimd_crit_unlock(&scanner->snapshot_lock);
+    scanner->watching = snapshot != NULL && snapshot->watch != NULL;
+    swimd_snapshot_release(old);
+}
+
+static SwimdSnapshot* swimd_snapshot_scan(const char *root_path,
+        SwimdScanner *scanner,
+        bool refreshing) {
+    SwimdSnapshot *snapshot = calloc(1, sizeof(SwimdSnapshot));
+    snapshot->refs = 1;
+    snapshot->scan_path = malloc((strlen(root_path) + 1) * sizeof(char));
+    strcpy(snapshot->scan_path, root_path);
+    snapshot->base_path = malloc(MAX_PATH_LENGTH * sizeof(char));
+    snapshot->base_path[0] = '\0'; // left empty when the git scanner finds no repository
+    snapshot->files = malloc(sizeof(SwimdFileList));
+    snapshot->folders = malloc(sizeof(SwimdFolderStruct));
+    swimd_init_root_folder(snapshot->folders);
+
+    swimd_file_list_init(snapshot->files);
+    swimd_folders_init(&snapshot->folders->folder_lst);
+
+    scanner->scanning_func(root_path,
+            snapshot->base_path,
+            snapshot->files,
+            snapshot->folders,
+            refreshing);
+    if (scanner->scan_unchanged) {
+        scanner->scan_unchanged = false;
+        swimd_snapshot_free(snapshot);
+        return NULL;
+    }
+    snapshot->watch = scanner->scan_watch;
+    scanner->scan_watch = NULL;
+
+    swimd_prep_files_vec(snapshot);
+    swimd_scores_init(snapshot);
+    return snapshot;
+}
+
+// Published while the initial scan runs and grown by swimd_snapshot_stream.
+// Names and folders belong to the scan, so it only owns its arrays.
+static SwimdSnapshot* swimd_snapshot_partial(const char *root_path) {
+    SwimdSnapshot *snapshot = calloc(1, sizeof(SwimdSnapshot));
+    snapshot->refs = 1;
+    snapshot->partial = true;
+    snapshot->scan_path = malloc((strlen(root_path) + 1) * sizeof(char));
+    strcpy(snapshot->scan_path, root_path);
+    snapshot->base_path = malloc((strlen(root_path) + 1) * sizeof(char));
+    strcpy(snapshot->base_path, root_path);
+    snapshot->files = malloc(sizeof(SwimdFileList));
+    swimd_file_list_init(snapshot->files);
+    swimd_scores_init(snapshot);
+    return snapshot;
+}
+
+// Runs on the scanner thread while it waits for the walk, the chunk blocks are
+// linked in under the state lock so a query sees whole chunks only.
+static void swimd_snapshot_stream(SwimdScanner *scanner, SwimdFileList *chunk) {
+    SwimdSnapshot *snapshot = scanner->snapshot;
+    if (snapshot == NULL || !snapshot->partial)
+        return;
+    swimd_crit_lock(&scanner->scan_state_lock);
+    int first_file = snapshot->files->length;
+    swimd_file_list_append_all(snapshot->files, chunk);
+    swimd_snapshot_append_blocks(snapshot, first_file);
+    swimd_crit_unlock(&scanner->scan_state_lock);
+
+    if (snapshot->files->length - scanner->notify_files_count >= NOTIFY_PROGRESS_FILES) {
+        scanner->notify_files_count = snapshot->files->length;
+        swimd_notify(SWIMD_NOTIFY_SCAN);
+    }
+}
+
+static void swimd_scanner_init(const char *root_path, SwimdScanner *scanner) {
+    swimd_log_append(SWIMD_INFO, "Scanning path started %s", root_path);
+    scanner->notify_files_count = 0;
+
+    // the index answers queries until the scan revalidates it
+    SwimdSnapshot *cached = swimd_index_load(scanner, root_path);
+    SwimdSnapshot *partial = cached != NULL ? cached : swimd_snapshot_partial(root_path);
+    swimd_snapshot_publish(scanner, partial);
+    SwimdSnapshot *snapshot = swimd_snapshot_scan(root_path, scanner, false);
+    if (cached == NULL) {
+        // queries may still hold the partial snapshot once the scan is out
+        swimd_atomic_fetch_add(&snapshot->refs, 1);
+        swimd_crit_lock(&scanner->scan_state_lock);
+        partial->tree_owner = snapshot;
+        swimd_crit_unlock(&scanner->scan_state_lock);
+    }
+    swimd_snapshot_publish(scanner, snapshot);
+    if (!scanner->scan_cancelled)
+        swimd_index_write(scanner, snapshot);
 
     swimd_log_append(SWIMD_INFO, "Scanning path completed");
 }
@@ -1492,37 +4580,551 @@ static void swimd_scanner_init(const char *root_path, SwimdScanner *scanner) {
 static void swimd_scanner_refresh(const char *root_path, SwimdScanner *scanner) {
     swimd_log_append(SWIMD_INFO, "Refreshing path started %s", root_path);
 
-    SwimdFileList *files = malloc(sizeof(SwimdFileList));
-    SwimdFolderStruct *folders = malloc(sizeof(SwimdFolderStruct));
-    char *base_path = malloc(MAX_PATH_LENGTH * sizeof(char));
-    swimd_init_root_folder(folders);
+    SwimdSnapshot *snapshot = swimd_snapshot_scan(root_path, scanner, true);
+    if (snapshot == NULL) {
+        scanner->scan_files_refresh_count = scanner->scan_files_count;
+        swimd_log_append(SWIMD_INFO, "Refreshing path completed, nothing changed");
+        return;
+    }
+    scanner->scan_files_count = scanner->scan_files_refresh_count;
+    scanner->watch_overflowed = false;
+    swimd_snapshot_publish(scanner, snapshot);
+    if (!scanner->scan_cancelled)
+        swimd_index_write(scanner, snapshot);
 
-    swimd_file_list_init(files);
-    swimd_folders_init(&folders->folder_lst);
+    swimd_log_append(SWIMD_INFO, "Refreshing path completed");
+}
 
-    scanner->scanning_func(root_path, base_path, files, folders, true);
+#ifndef _WIN32
+// One name touched by a batch of events, merged over the batch by folder, name
+// and kind.
+typedef struct {
+    SwimdFolderStruct *folder;
+    SwimdIgnore *ignore;
+    char *name;
+    int name_length;
+    bool is_dir;
+    bool deleted; // removed at some point, whatever was indexed goes
+    bool created; // exists at the end of the batch
+    bool present; // file still indexed, e.g. read by the walk and reported too
+    bool walk; // new directory, read once the state lock is released
+} SwimdWatchChange;
 
-    swimd_crit_lock(&scanner->scan_state_swap);
+typedef struct {
+    SwimdWatchChange *arr;
+    int length;
+    int capacity;
+    int *table; // open addressing over arr, -1 for empty slots
+    int table_capacity;
+} SwimdWatchBatch;
 
-    swimd_scanner_free(scanner);
+typedef struct {
+    void **arr;
+    int length;
+    int capacity;
+} SwimdPtrSet;
 
-    scanner->files = files;
-    scanner->folders = folders;
-    scanner->base_path = base_path;
-    scanner->scan_files_count = scanner->scan_files_refresh_count;
+static int swimd_ptr_set_pos(SwimdPtrSet *set, const void *ptr) {
+    int mask = set->capacity - 1;
+    int pos = (int)(((uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ULL) >> 40) & mask;
+    while (set->arr[pos] != NULL && set->arr[pos] != ptr) {
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+static void swimd_ptr_set_add(SwimdPtrSet *set, void *ptr) {
+    if ((set->length + 1) * 2 > set->capacity) {
+        SwimdPtrSet grown = {
+            .capacity = MAX(set->capacity * 2, 64),
+            .length = set->length,
+        };
+        grown.arr = calloc(grown.capacity, sizeof(void*));
+        for (int i = 0; i < set->capacity; i++) {
+            if (set->arr[i] != NULL)
+                grown.arr[swimd_ptr_set_pos(&grown, set->arr[i])] = set->arr[i];
+        }
+        free(set->arr);
+        *set = grown;
+    }
+    int pos = swimd_ptr_set_pos(set, ptr);
+    if (set->arr[pos] == NULL) {
+        set->arr[pos] = ptr;
+        set->length++;
+    }
+}
 
-    swimd_prep_files_vec(scanner);
-    swimd_scores_init(scanner);
+static bool swimd_ptr_set_contains(SwimdPtrSet *set, const void *ptr) {
+    return set->length > 0 && set->arr[swimd_ptr_set_pos(set, ptr)] != NULL;
+}
 
-    swimd_crit_unlock(&scanner->scan_state_swap);
+static uint64_t swimd_watch_change_hash(const SwimdFolderStruct *folder,
+        const char *name,
+        int name_length,
+        bool is_dir) {
+    uint64_t hash = 14695981039346656037ULL ^ (uint64_t)(uintptr_t)folder ^ is_dir;
+    for (int i = 0; i < name_length; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+    }
+    return hash ^ (hash >> 32);
+}
 
-    swimd_log_append(SWIMD_INFO, "Refreshing path completed");
+static int* swimd_watch_batch_slot(SwimdWatchBatch *batch,
+        const SwimdFolderStruct *folder,
+        const char *name,
+        int name_length,
+        bool is_dir) {
+    int mask = batch->table_capacity - 1;
+    int pos = swimd_watch_change_hash(folder, name, name_length, is_dir) & mask;
+    while (1) {
+        int *slot = &batch->table[pos];
+        if (*slot < 0)
+            return slot;
+        SwimdWatchChange *change = &batch->arr[*slot];
+        if (change->folder == folder &&
+                change->is_dir == is_dir &&
+                change->name_length == name_length &&
+                memcmp(change->name, name, name_length) == 0)
+            return slot;
+        pos = (pos + 1) & mask;
+    }
+}
+
+static SwimdWatchChange* swimd_watch_batch_find(SwimdWatchBatch *batch,
+        const SwimdFolderStruct *folder,
+        const char *name,
+        int name_length,
+        bool is_dir) {
+    if (batch->length == 0)
+        return NULL;
+    int index = *swimd_watch_batch_slot(batch, folder, name, name_length, is_dir);
+    return index < 0 ? NULL : &batch->arr[index];
+}
+
+static void swimd_watch_batch_note(SwimdWatchBatch *batch,
+        SwimdWatchEntry *entry,
+        const char *name,
+        bool is_dir,
+        bool created) {
+    if ((batch->length + 1) * 2 > batch->table_capacity) {
+        batch->table_capacity = MAX(batch->table_capacity * 2, 64);
+        free(batch->table);
+        batch->table = malloc(batch->table_capacity * sizeof(int));
+        memset(batch->table, -1, batch->table_capacity * sizeof(int));
+        for (int i = 0; i < batch->length; i++) {
+            SwimdWatchChange *change = &batch->arr[i];
+            *swimd_watch_batch_slot(batch,
+                    change->folder,
+                    change->name,
+                    change->name_length,
+                    change->is_dir) = i;
+        }
+    }
+
+    int name_length = strlen(name);
+    int *slot = swimd_watch_batch_slot(batch, entry->folder, name, name_length, is_dir);
+    if (*slot < 0) {
+        if (batch->length == batch->capacity) {
+            batch->capacity = MAX(batch->capacity * 2, 16);
+            batch->arr = realloc(batch->arr, batch->capacity * sizeof(SwimdWatchChange));
+        }
+        char *name_copy = malloc(name_length + 1);
+        memcpy(name_copy, name, name_length + 1);
+        *slot = batch->length;
+        batch->arr[batch->length++] = (SwimdWatchChange){
+            .folder = entry->folder,
+            .ignore = entry->ignore,
+            .name = name_copy,
+            .name_length = name_length,
+            .is_dir = is_dir,
+        };
+    }
+    SwimdWatchChange *change = &batch->arr[*slot];
+    change->created = created;
+    if (!created)
+        change->deleted = true;
+}
+
+static void swimd_watch_batch_free(SwimdWatchBatch *batch) {
+    for (int i = 0; i < batch->length; i++) {
+        free(batch->arr[i].name);
+    }
+    free(batch->arr);
+    free(batch->table);
+}
+
+// Drains the inotify queue. Returns false when the kernel queue overflowed and
+// events were lost.
+static bool swimd_watch_read(SwimdWatch *watch, SwimdWatchBatch *batch) {
+    char buf[WATCH_EVENTS_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool complete = true;
+    while (1) {
+        long length = read(watch->fd, buf, sizeof(buf));
+        if (length <= 0)
+            break;
+        for (long pos = 0; pos < length;) {
+            struct inotify_event *event = (struct inotify_event*)&buf[pos];
+            pos += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                complete = false;
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= watch->capacity)
+                continue;
+            SwimdWatchEntry *entry = &watch->arr[event->wd];
+            if (event->mask & IN_IGNORED) {
+                *entry = (SwimdWatchEntry){0};
+                continue;
+            }
+            if (entry->folder == NULL || event->len == 0)
+                continue;
+
+            bool is_dir = (event->mask & IN_ISDIR) != 0;
+            if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                swimd_watch_batch_note(batch, entry, event->name, is_dir, true);
+            } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                swimd_watch_batch_note(batch, entry, event->name, is_dir, false);
+            }
+        }
+    }
+    return complete;
+}
+
+static void swimd_watch_collect_folders(SwimdFolderStruct *folder, SwimdPtrSet *folders) {
+    swimd_ptr_set_add(folders, folder);
+    for (int i = 0; i < folder->folder_lst.length; i++) {
+        swimd_watch_collect_folders(folder->folder_lst.arr[i], folders);
+    }
+}
+
+static void swimd_watch_detach_folder(SwimdFolderStruct *folder) {
+    SwimdFolderStructList *siblings = &folder->parent->folder_lst;
+    for (int i = 0; i < siblings->length; i++) {
+        if (siblings->arr[i] == folder) {
+            memmove(&siblings->arr[i],
+                    &siblings->arr[i + 1],
+                    (siblings->length - i - 1) * sizeof(SwimdFolderStruct*));
+            siblings->length--;
+            break;
+        }
+    }
+}
+
+// Drops the watches and ignore levels that belong to removed folders.
+static void swimd_watch_forget_folders(SwimdWatch *watch, SwimdPtrSet *removed) {
+    for (int wd = 0; wd < watch->capacity; wd++) {
+        if (watch->arr[wd].folder != NULL && swimd_ptr_set_contains(removed, watch->arr[wd].folder)) {
+            inotify_rm_watch(watch->fd, wd);
+            watch->arr[wd] = (SwimdWatchEntry){0};
+        }
+    }
+    SwimdIgnore **link = &watch->ignores;
+    while (*link != NULL) {
+        SwimdIgnore *level = *link;
+        if (swimd_ptr_set_contains(removed, level->folder)) {
+            *link = level->next;
+            level->next = NULL;
+            swimd_ignore_free(level);
+        } else {
+            link = &level->next;
+        }
+    }
+}
+
+// Reads a directory that appeared in the tree on the scanner thread, its files
+// are appended to the list and its directories get watched. Queries never look
+// at the children of a folder, so the tree grows without the state lock.
+static void swimd_watch_walk_folder(SwimdScanner *scanner,
+        SwimdSnapshot *snapshot,
+        SwimdWatchChange *change,
+        SwimdFileList *files) {
+    char path[4096];
+    int root_length = strlen(snapshot->scan_path);
+    if (root_length + 1 >= (int)sizeof(path))
+        return;
+    memcpy(path, snapshot->scan_path, root_length);
+    path[root_length] = '/';
+    if (!swimd_folder_relative_path(&path[root_length + 1],
+            sizeof(path) - root_length - 1,
+            snapshot->folders,
+            change->folder,
+            change->name))
+        return;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    SwimdFolderStruct *folder_node = malloc(sizeof(SwimdFolderStruct));
+    folder_node->name = change->name;
+    folder_node->name_length = change->name_length;
+    folder_node->parent = change->folder;
+    folder_node->path = NULL;
+    swimd_folders_init(&folder_node->folder_lst);
+    swimd_folders_append(&change->folder->folder_lst, folder_node);
+    change->name = NULL;
+
+    swimd_walk_tree(scanner,
+            fd,
+            folder_node,
+            change->ignore,
+            files,
+            &scanner->scan_files_count,
+            snapshot->watch,
+            false,
+            false,
+            NULL,
+            1);
+}
+
+// Removed files keep their list index with a NULL folder and their lane slot
+// turns into padding. Once they or the added blocks pile up, the live files go
+// to a new snapshot that takes over the tree and is packed outside the state
+// lock like a scan.
+static bool swimd_watch_needs_repack(SwimdSnapshot *snapshot) {
+    int added_blocks = snapshot->files_vec_length - snapshot->files_vec_arena_length;
+    return snapshot->watch->removed_count > snapshot->files->length / 8 ||
+        added_blocks > MAX(SCORE_CHUNK_BLOCKS, snapshot->files_vec_arena_length / 8);
+}
+
+// Takes over the reference to the acquired snapshot. The packed snapshot owns
+// the tree from now on, the old one borrows it until its last query is done.
+static void swimd_watch_repack(SwimdScanner *scanner, SwimdSnapshot *snapshot) {
+    SwimdFileList *files = snapshot->files;
+    SwimdSnapshot *packed = calloc(1, sizeof(SwimdSnapshot));
+    packed->refs = 1;
+    packed->scan_path = malloc((strlen(snapshot->scan_path) + 1) * sizeof(char));
+    strcpy(packed->scan_path, snapshot->scan_path);
+    packed->base_path = malloc((strlen(snapshot->base_path) + 1) * sizeof(char));
+    strcpy(packed->base_path, snapshot->base_path);
+    packed->folders = snapshot->folders;
+    packed->watch = snapshot->watch;
+    packed->files = malloc(sizeof(SwimdFileList));
+    swimd_file_list_init(packed->files);
+    for (int i = 0; i < files->length; i++) {
+        if (files->arr[i].folder != NULL)
+            swimd_file_list_push(packed->files, files->arr[i]);
+    }
+    swimd_prep_files_vec(packed);
+    swimd_scores_init(packed);
+    packed->watch->removed_count = 0;
+
+    swimd_atomic_fetch_add(&packed->refs, 1);
+    swimd_crit_lock(&scanner->scan_state_lock);
+    snapshot->tree_owner = packed;
+    swimd_crit_unlock(&scanner->scan_state_lock);
+    swimd_snapshot_publish(scanner, packed);
+    swimd_snapshot_release(snapshot);
+}
+
+static void swimd_watch_apply_batch(SwimdScanner *scanner,
+        SwimdSnapshot *snapshot,
+        SwimdWatchBatch *batch) {
+    SwimdWatch *watch = snapshot->watch;
+    SwimdFileList *files = snapshot->files;
+    int lanes = swimd_kernel.lanes;
+
+    SwimdPtrSet removed = {0};
+    SwimdFolderStructList removed_roots;
+    swimd_folders_init(&removed_roots);
+    for (int i = 0; i < batch->length; i++) {
+        SwimdWatchChange *change = &batch->arr[i];
+        if (!change->is_dir || !change->deleted || swimd_ptr_set_contains(&removed, change->folder))
+            continue;
+        SwimdFolderStruct *folder = swimd_folder_find_child(change->name,
+                change->name_length,
+                change->folder);
+        if (folder == NULL)
+            continue;
+        swimd_watch_detach_folder(folder);
+        swimd_watch_collect_folders(folder, &removed);
+        swimd_folders_append(&removed_roots, folder);
+    }
+    if (removed.length > 0)
+        swimd_watch_forget_folders(watch, &removed);
+
+    SwimdPtrSet touched = {0};
+    for (int i = 0; i < batch->length; i++) {
+        SwimdWatchChange *change = &batch->arr[i];
+        if (!change->is_dir && !swimd_ptr_set_contains(&removed, change->folder))
+            swimd_ptr_set_add(&touched, change->folder);
+    }
+
+    int removed_count = 0;
+    if (removed.length > 0 || touched.length > 0) {
+        for (int i = 0; i < files->length; i++) {
+            SwimdFile *file = &files->arr[i];
+            if (file->folder == NULL)
+                continue;
+            bool remove = swimd_ptr_set_contains(&removed, file->folder);
+            if (!remove && swimd_ptr_set_contains(&touched, file->folder)) {
+                SwimdWatchChange *change = swimd_watch_batch_find(batch,
+                        file->folder,
+                        file->name,
+                        file->name_length,
+                        false);
+                if (change != NULL) {
+                    remove = change->deleted;
+                    change->present = !change->deleted;
+                }
+            }
+            if (remove) {
+                free(file->name);
+                *file = (SwimdFile){0};
+                removed_count++;
+            }
+        }
+    }
+    if (removed_count > 0) {
+        for (int slot = 0; slot < snapshot->files_vec_length * lanes; slot++) {
+            int file_index = snapshot->files_vec_index[slot];
+            if (file_index < 0 || files->arr[file_index].folder != NULL)
+                continue;
+            SwimdFileVec *file_vec = &snapshot->files_vec[slot / lanes];
+            for (int k = 0; k < file_vec->length; k += lanes) {
+                file_vec->arr[k + slot % lanes] = 0;
+            }
+            snapshot->files_vec_index[slot] = -1;
+        }
+    }
+    for (int i = 0; i < removed_roots.length; i++) {
+        SwimdFolderStruct *folder = removed_roots.arr[i];
+        swimd_list_directories_folders_free(folder);
+        swimd_folders_free(&folder->folder_lst);
+        free(folder->name);
+        free(folder->path);
+        free(folder);
+    }
+    swimd_folders_free(&removed_roots);
+
+    int first_file = files->length;
+    for (int i = 0; i < batch->length; i++) {
+        SwimdWatchChange *change = &batch->arr[i];
+        if (!change->created || change->present || swimd_ptr_set_contains(&removed, change->folder))
+            continue;
+        if (change->ignore != NULL &&
+                swimd_ignore_match(change->ignore, change->folder, change->name, change->is_dir))
+            continue;
+        if (change->is_dir) {
+            change->walk = true;
+        } else if (swimd_folder_prefix_length(change->folder) + change->name_length < MAX_PATH_LENGTH) {
+            swimd_file_list_push(files, (SwimdFile){
+                .name = change->name,
+                .name_length = change->name_length,
+                .folder = change->folder,
+            });
+            change->name = NULL;
+            swimd_atomic_fetch_add(&scanner->scan_files_count, 1);
+        }
+    }
+    int added_count = files->length - first_file;
+    swimd_snapshot_append_blocks(snapshot, first_file);
+    if (removed_count > 0)
+        swimd_snapshot_stamp(snapshot);
+
+    swimd_atomic_fetch_add(&scanner->scan_files_count, -removed_count);
+    watch->removed_count += removed_count;
+    free(removed.arr);
+    free(touched.arr);
+
+    swimd_log_append(SWIMD_INFO, "Watch applied %d changes, %d files added, %d removed",
+            batch->length,
+            added_count,
+            removed_count);
+}
+
+// Runs on the scanner thread between scans. The snapshot is edited in place
+// under the state lock so queries never see a half applied batch.
+static void swimd_watch_apply(SwimdScanner *scanner) {
+    SwimdSnapshot *snapshot = swimd_snapshot_acquire(scanner);
+    if (snapshot == NULL || snapshot->watch == NULL) {
+        swimd_snapshot_release(snapshot);
+        return;
+    }
+    swimd_crit_lock(&scanner->scan_state_lock);
+    SwimdWatchBatch batch = {0};
+    if (!swimd_watch_read(snapshot->watch, &batch) && !scanner->watch_overflowed) {
+        swimd_log_append(SWIMD_WARN, "Watch events lost, rescan on the next query");
+        scanner->watch_overflowed = true;
+    }
+    if (batch.length > 0)
+        swimd_watch_apply_batch(scanner, snapshot, &batch);
+    swimd_crit_unlock(&scanner->scan_state_lock);
+
+    // a clone or an untar can take a while to read, queries go on meanwhile
+    SwimdFileList walked;
+    swimd_file_list_init(&walked);
+    for (int i = 0; i < batch.length; i++) {
+        SwimdWatchChange *change = &batch.arr[i];
+        if (change->walk &&
+                swimd_folder_find_child(change->name, change->name_length, change->folder) == NULL)
+            swimd_watch_walk_folder(scanner, snapshot, change, &walked);
+    }
+    if (walked.length > 0) {
+        swimd_crit_lock(&scanner->scan_state_lock);
+        int first_file = snapshot->files->length;
+        swimd_file_list_append_all(snapshot->files, &walked);
+        swimd_snapshot_append_blocks(snapshot, first_file);
+        swimd_crit_unlock(&scanner->scan_state_lock);
+        swimd_log_append(SWIMD_INFO, "Watch walked new folders, %d files added", walked.length);
+    }
+    swimd_file_list_free(&walked);
+    swimd_watch_batch_free(&batch);
+
+    if (swimd_watch_needs_repack(snapshot))
+        swimd_watch_repack(scanner, snapshot);
+    else
+        swimd_snapshot_release(snapshot);
+}
+#endif
+
+#ifndef _WIN32
+// Blocks until the watch has events or a scan is requested, true for the
+// latter once its event is taken.
+static bool swimd_scan_wait_watch(SwimdScanner *scanner) {
+    SwimdSnapshot *snapshot = scanner->snapshot;
+    struct pollfd fds[] = {
+        { .fd = scanner->scan_wake_fd, .events = POLLIN },
+        { .fd = snapshot != NULL && snapshot->watch != NULL ? snapshot->watch->fd : -1, .events = POLLIN },
+    };
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            swimd_log_append(SWIMD_ERR, "Unable to poll the watch, errno %d", errno);
+            swimd_are_wait(&scanner->scan_begin);
+            return true;
+        }
+        if (fds[0].revents != 0) {
+            uint64_t count;
+            if (read(scanner->scan_wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                swimd_log_append(SWIMD_WARN, "Unable to drain scan wake fd, errno %d", errno);
+            // writes left over from before the watch was set up have no event
+            if (swimd_are_wait_timeout(&scanner->scan_begin, 0))
+                return true;
+        }
+        if (fds[1].revents != 0)
+            return false;
+    }
 }
+#endif
 
 static void swimd_scanning_loop_impl(SwimdScanner *scanner) {
     swimd_log_append(SWIMD_INFO, "Scanning loop start");
     while (1) {
+#ifndef _WIN32
+        // with a watch the thread wakes up to apply its events between scans
+        if (scanner->watching) {
+            if (!swimd_scan_wait_watch(scanner)) {
+                swimd_watch_apply(scanner);
+                continue;
+            }
+        } else {
+            swimd_are_wait(&scanner->scan_begin);
+        }
+#else
         swimd_are_wait(&scanner->scan_begin);
+#endif
 
         if (scanner->scan_terminate)
             break;
@@ -1540,6 +5142,7 @@ static void swimd_scanning_loop_impl(SwimdScanner *scanner) {
         scanner->scan_is_refreshing = false;
 
         swimd_mre_set(&scanner->scan_finished);
+        swimd_notify(SWIMD_NOTIFY_SCAN);
     }
     swimd_log_append(SWIMD_INFO, "Scanning loop exit");
 }
@@ -1570,33 +5173,14 @@ static void swimd_scan_thread_init(SwimdScanner *scanner) {
     swimd_are_init(&scanner->scan_begin, false);
     swimd_are_init(&scanner->scan_started, false);
     swimd_mre_init(&scanner->scan_finished, true);
+#ifndef _WIN32
+    scanner->scan_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
 
-    swimd_thread_create(&scanner->scan_thread, scanner->scanning_loop);
-
-    swimd_crit_init(&scanner->scan_state_swap);
-}
-
-static void swimd_d_vec_init(SwimdScanner *scanner) {
-    scanner->d_vec = malloc(MAX_PATH_LENGTH * MAX_PATH_LENGTH * LANES_COUNT_SHORT * sizeof(short));
-    memset(scanner->d_vec, 0, MAX_PATH_LENGTH * MAX_PATH_LENGTH * LANES_COUNT_SHORT * sizeof(short));
-    for (int i = 1; i < MAX_PATH_LENGTH; i++) {
-        short value = scanner->d_vec[D_IND(i - 1, 0)];
-        value += scanner->gap_distr_fun[i - 1];
-        for (int j = 0; j < LANES_COUNT_SHORT; j++) {
-            scanner->d_vec[D_IND(i, 0) + j] = value;
-        }
-    }
-    for (int i = 1; i < MAX_PATH_LENGTH; i++) {
-        short value = scanner->d_vec[D_IND(0, i - 1)];
-        value += scanner->gap_distr_fun[i - 1];
-        for (int j = 0; j < LANES_COUNT_SHORT; j++) {
-            scanner->d_vec[D_IND(0, i) + j] = value;
-        }
-    }
-}
+    swimd_crit_init(&scanner->scan_state_lock);
+    swimd_crit_init(&scanner->snapshot_lock);
 
-static void swimd_d_vec_free(SwimdScanner *scanner) {
-    free(scanner->d_vec);
+    swimd_thread_create(&scanner->scan_thread, scanner->scanning_loop, NULL);
 }
 
 static void swimd_gap_distr_fun_custom(short *arr, int n) {
@@ -1643,9 +5227,199 @@ static void swimd_gap_distr_free(SwimdScanner *scanner) {
     free(scanner->gap_distr_sum);
 }
 
+static void swimd_border_row_init(short **border_row, short *gap_distr_sum) {
+    short *row = malloc(MAX_PATH_LENGTH * swimd_kernel.lanes * sizeof(short));
+    for (int j = 1; j < MAX_PATH_LENGTH; j++) {
+        for (int k = 0; k < swimd_kernel.lanes; k++) {
+            row[swimd_kernel.lanes * (j - 1) + k] = gap_distr_sum[j];
+        }
+    }
+    *border_row = row;
+}
+
+// A full worker heap proves the global top K is at least its head, so every
+// worker may prune against the best head seen so far.
+static void swimd_score_pool_raise_prune_score(SwimdScorePool *pool,
+        SwimdScoresHeap *scores_heap) {
+    if (scores_heap->size < scores_heap->max_size)
+        return;
+    long score = scores_heap->arr[0].score;
+    while (1) {
+        long prune_score = pool->prune_score;
+        if (prune_score >= score)
+            return;
+        if (swimd_atomic_cas(&pool->prune_score, prune_score, score))
+            return;
+    }
+}
+
+static void swimd_score_worker_impl(SwimdScoreWorker *worker) {
+    SwimdScorePool *pool = &swimd_score_pool;
+    while (1) {
+        swimd_are_wait(&worker->work_begin);
+
+        if (pool->terminate)
+            break;
+
+        SwimdScanner *scanner = pool->scanner;
+        SwimdSnapshot *snapshot = pool->snapshot;
+        swimd_scores_heap_init(&worker->scores_heap, pool->max_size);
+        worker->match_count = 0;
+        worker->pruned_count = 0;
+
+        while (1) {
+            long begin = swimd_atomic_fetch_add(&pool->next_block, SCORE_CHUNK_BLOCKS);
+            if (begin >= snapshot->files_vec_length)
+                break;
+            long end = MIN(begin + SCORE_CHUNK_BLOCKS, snapshot->files_vec_length);
+
+            for (long i = begin; i < end; i++) {
+                SwimdFileVec *file_vec = &snapshot->files_vec[i];
+                // a newer query was submitted, the rest is skipped so the rows
+                // cache stays valid for the needle saved by this one
+                bool aborted = pool->query_id != 0 &&
+                    pool->query_id != swimd_query_queue.submitted_id;
+                if (aborted || !swimd_block_can_score(scanner, file_vec, pool->prune_score)) {
+                    swimd_rows_skip(file_vec, snapshot->rows_prefix_length);
+                    worker->pruned_count++;
+                    continue;
+                }
+                swimd_simd_haystack_scores(
+                    worker->row,
+                    worker->byte_row,
+                    pool->border_row,
+                    scanner,
+                    snapshot,
+                    file_vec,
+                    i,
+                    pool->gap_distr_fun,
+                    pool->gap_distr_sum
+                );
+                worker->match_count += swimd_top_scores_range(scanner,
+                        snapshot,
+                        &worker->scores_heap,
+                        i * swimd_kernel.lanes,
+                        (i + 1) * swimd_kernel.lanes);
+                swimd_score_pool_raise_prune_score(pool, &worker->scores_heap);
+            }
+        }
+
+        swimd_are_set(&worker->work_done);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI swimd_score_worker_loop(LPVOID lp_param) {
+    swimd_score_worker_impl((SwimdScoreWorker*)lp_param);
+    return 0;
+}
+#else
+static void* swimd_score_worker_loop(void *lp_param) {
+    swimd_score_worker_impl((SwimdScoreWorker*)lp_param);
+    return NULL;
+}
+#endif
+
+static void swimd_score_pool_init(void) {
+    SwimdScorePool *pool = &swimd_score_pool;
+    int workers_count = MIN(MAX(swimd_cpu_count(), 1), MAX_SCORE_WORKERS);
+
+    pool->gap_distr_fun = malloc(MAX_PATH_LENGTH * sizeof(short));
+    pool->gap_distr_sum = malloc(MAX_PATH_LENGTH * sizeof(short));
+    swimd_gap_distr_fun(pool->gap_distr_fun, MAX_PATH_LENGTH);
+    swimd_gap_distr_sum(pool->gap_distr_sum, pool->gap_distr_fun, MAX_PATH_LENGTH);
+    swimd_border_row_init(&pool->border_row, pool->gap_distr_sum);
+
+    pool->terminate = false;
+    pool->workers_count = workers_count;
+    pool->workers = malloc(workers_count * sizeof(SwimdScoreWorker));
+    swimd_crit_init(&pool->work_lock);
+
+    for (int i = 0; i < workers_count; i++) {
+        SwimdScoreWorker *worker = &pool->workers[i];
+        worker->row = swimd_aligned_alloc(MAX_PATH_LENGTH * swimd_kernel.lanes * sizeof(short));
+        worker->byte_row = swimd_aligned_alloc(MAX_PATH_LENGTH * swimd_kernel.lanes);
+        swimd_are_init(&worker->work_begin, false);
+        swimd_are_init(&worker->work_done, false);
+        swimd_thread_create(&worker->thread, &swimd_score_worker_loop, worker);
+    }
+    swimd_log_append(SWIMD_INFO, "Score pool started with %d workers", workers_count);
+}
+
+static void swimd_score_pool_free(void) {
+    SwimdScorePool *pool = &swimd_score_pool;
+    pool->terminate = true;
+    for (int i = 0; i < pool->workers_count; i++) {
+        SwimdScoreWorker *worker = &pool->workers[i];
+        swimd_are_set(&worker->work_begin);
+        swimd_thread_join(&worker->thread);
+        swimd_thread_close(&worker->thread);
+        swimd_are_close(&worker->work_begin);
+        swimd_are_close(&worker->work_done);
+        swimd_aligned_free(worker->row, MAX_PATH_LENGTH * swimd_kernel.lanes * sizeof(short));
+        swimd_aligned_free(worker->byte_row, MAX_PATH_LENGTH * swimd_kernel.lanes);
+    }
+    swimd_crit_close(&pool->work_lock);
+    free(pool->workers);
+    free(pool->gap_distr_fun);
+    free(pool->gap_distr_sum);
+    free(pool->border_row);
+    pool->workers = NULL;
+    pool->workers_count = 0;
+}
+
+static int swimd_top_scores(int n,
+        SwimdScanner *scanner,
+        SwimdSnapshot *snapshot,
+        long query_id) {
+    SwimdScorePool *pool = &swimd_score_pool;
+    int match_count = 0;
+    int pruned_count = 0;
+    swimd_scores_heap_init(&scanner->scores_heap, n);
+
+    swimd_crit_lock(&pool->work_lock);
+
+    pool->scanner = scanner;
+    pool->snapshot = snapshot;
+    pool->max_size = n;
+    pool->query_id = query_id;
+    pool->next_block = 0;
+    pool->prune_score = 0;
+    for (int i = 0; i < pool->workers_count; i++) {
+        swimd_are_set(&pool->workers[i].work_begin);
+    }
+    for (int i = 0; i < pool->workers_count; i++) {
+        SwimdScoreWorker *worker = &pool->workers[i];
+        swimd_are_wait(&worker->work_done);
+
+        for (int j = 0; j < worker->scores_heap.size; j++) {
+            swimd_scores_heap_insert(&scanner->scores_heap, worker->scores_heap.arr[j]);
+        }
+        match_count += worker->match_count;
+        pruned_count += worker->pruned_count;
+        swimd_scores_heap_free(&worker->scores_heap);
+    }
+    pool->scanner = NULL;
+    pool->snapshot = NULL;
+
+    swimd_crit_unlock(&pool->work_lock);
+
+#ifdef DEBUG_PRINT
+    swimd_log_append(SWIMD_DEBUG, "Pruned %d of %d blocks",
+            pruned_count,
+            snapshot->files_vec_length);
+#endif
+
+    qsort(scanner->scores_heap.arr,
+            scanner->scores_heap.size,
+            sizeof(SwimdScoresHeapItem),
+            swimd_compare_heap_item);
+
+    return match_count;
+}
+
 static void swimd_scan_glob_init(SwimdScanner *scanner) {
     swimd_gap_distr_init(scanner);
-    swimd_d_vec_init(scanner);
     swimd_scan_thread_init(scanner);
 }
 
@@ -1653,19 +5427,31 @@ static void swimd_scan_path_free(SwimdScanner *scanner) {
     free(scanner->scan_path);
 }
 
+// A watching scanner thread blocks in poll, so the request goes through its
+// wake fd too.
+static void swimd_scan_begin(SwimdScanner *scanner) {
+    swimd_are_set(&scanner->scan_begin);
+#ifndef _WIN32
+    uint64_t one = 1;
+    if (write(scanner->scan_wake_fd, &one, sizeof(one)) < 0)
+        swimd_log_append(SWIMD_WARN, "Unable to wake the scanner, errno %d", errno);
+#endif
+}
+
 static void swimd_scan_thread_stop(SwimdScanner *scanner) {
     scanner->scan_cancelled = true;
     swimd_mre_wait(&scanner->scan_finished);
     scanner->scan_cancelled = false;
 
     scanner->scan_terminate = true;
-    swimd_are_set(&scanner->scan_begin);
+    swimd_scan_begin(scanner);
     swimd_thread_join(&scanner->scan_thread);
     scanner->scan_terminate = false;
 
     if (scanner->scan_path != NULL) {
         swimd_scan_path_free(scanner);
-        swimd_scanner_free(scanner);
+        swimd_snapshot_publish(scanner, NULL);
+        swimd_git_state_free(scanner);
         scanner->scan_path = NULL;
     }
 
@@ -1673,14 +5459,19 @@ static void swimd_scan_thread_stop(SwimdScanner *scanner) {
     swimd_are_close(&scanner->scan_started);
     swimd_mre_close(&scanner->scan_finished);
     swimd_thread_close(&scanner->scan_thread);
+#ifndef _WIN32
+    close(scanner->scan_wake_fd);
+#endif
 
-    swimd_crit_close(&scanner->scan_state_swap);
+    swimd_crit_close(&scanner->scan_state_lock);
+    swimd_crit_close(&scanner->snapshot_lock);
 }
 
 static void swimd_scan_glob_free(SwimdScanner *scanner) {
     swimd_scan_thread_stop(scanner);
     swimd_gap_distr_free(scanner);
-    swimd_d_vec_free(scanner);
+    swimd_query_hits_free(&scanner->ffi_hits);
+    swimd_scan_process_input_free(&scanner->ffi_result);
 }
 
 static void swimd_scan_setup_path(const char *scan_path, SwimdScanner *scanner) {
@@ -1690,7 +5481,8 @@ static void swimd_scan_setup_path(const char *scan_path, SwimdScanner *scanner)
 
     if (scanner->scan_path != NULL) {
         swimd_scan_path_free(scanner);
-        swimd_scanner_free(scanner);
+        swimd_snapshot_publish(scanner, NULL);
+        swimd_git_state_free(scanner);
         scanner->scan_path = NULL;
     }
 
@@ -1701,7 +5493,7 @@ static void swimd_scan_setup_path(const char *scan_path, SwimdScanner *scanner)
     scanner->scan_in_progress = true;
     scanner->scan_files_count = 0;
     scanner->scan_files_refresh_count = 0;
-    swimd_are_set(&scanner->scan_begin);
+    swimd_scan_begin(scanner);
     // need to wait until we start scanning, in order not to messup in cleanup when state has been not initialized
     swimd_are_wait(&scanner->scan_started);
 }
@@ -1725,7 +5517,7 @@ static void swimd_scan_refresh_path(SwimdScanner *scanner) {
     scanner->scan_in_progress = true;
     scanner->scan_is_refreshing = true;
     scanner->scan_files_refresh_count = 0;
-    swimd_are_set(&scanner->scan_begin);
+    swimd_scan_begin(scanner);
     // same
     swimd_are_wait(&scanner->scan_started);
 }
@@ -1778,96 +5570,355 @@ static void swimd_print_relative(char *file_path, char *scan_path, char *base_pa
     }
 }
 
-static void swimd_print_path(char *buf, SwimdFile *file) {
+// A folder tree only ever serves one scan path, also when a repack or a cached
+// index keeps it past its scan, so the relative prefix of a folder doesn't
+// change once printed and its files only append their names to it. Scans and the index
+// loader skip paths that don't fit in MAX_PATH_LENGTH, the prefix is cut there
+// all the same.
+static SwimdFolderStruct* swimd_folder_prefix(SwimdSnapshot *snapshot,
+        SwimdFolderStruct *folder) {
+    if (folder->path != NULL)
+        return folder;
+    // room for a "../" per level of the scan path
+    char *buf = malloc(swimd_folder_prefix_length(folder) +
+            3 * swimd_path_depth(snapshot->scan_path, PATH_SLASH_CHAR) + 2);
     int buf_length = 0;
-    for (int i = 0; i < file->name_length; i++) {
-        buf[buf_length++] = file->name[file->name_length - i - 1];
-    }
-    buf[buf_length++] = PATH_SLASH_CHAR;
-    SwimdFolderStruct *cur_folder = file->folder;
-    while (1) {
+    for (SwimdFolderStruct *cur_folder = folder;
+            !IS_ROOT_FOLDER(cur_folder);
+            cur_folder = cur_folder->parent) {
+        if (buf_length > 0)
+            buf[buf_length++] = PATH_SLASH_CHAR;
         for (int i = 0; i < cur_folder->name_length; i++) {
             buf[buf_length++] = cur_folder->name[cur_folder->name_length - i - 1];
         }
-        if (IS_ROOT_FOLDER(cur_folder))
-            break;
-        buf[buf_length++] = PATH_SLASH_CHAR;
-        cur_folder = cur_folder->parent;
     }
-    buf_length--;
     swimd_str_reverse(buf, buf_length);
-    buf[buf_length++] = '\0';
+    buf[buf_length] = '\0';
+    swimd_print_relative(buf, snapshot->scan_path, snapshot->base_path);
+
+    buf_length = MIN((int)strlen(buf), MAX_PATH_LENGTH - 1);
+    if (buf_length > 0 && buf[buf_length - 1] != PATH_SLASH_CHAR && buf_length < MAX_PATH_LENGTH - 1)
+        buf[buf_length++] = PATH_SLASH_CHAR;
+    buf[buf_length] = '\0';
+    folder->path = buf;
+    folder->path_length = buf_length;
+    return folder;
 }
 
 static void swimd_process_input(const char *needle,
         int max_size,
-        SwimdProcessInputResult *result,
-        SwimdScanner *scanner) {
+        SwimdQueryHits *hits,
+        SwimdScanner *scanner,
+        SwimdSnapshot *snapshot,
+        long query_id) {
     swimd_setup_needle(needle, scanner);
+    swimd_rows_setup_needle(scanner, snapshot);
 
-    swimd_simd_scores(scanner);
-    swimd_top_scores(max_size, scanner);
+    swimd_top_scores(max_size, scanner, snapshot, query_id);
+    swimd_rows_save_needle(scanner, snapshot);
 
-    result->items = malloc(max_size * sizeof(SwimdProcessInputResultItem));
+    // the heap is sorted worst first
+    int length = scanner->scores_heap.size;
+    if (length > hits->capacity) {
+        hits->capacity = length;
+        hits->arr = realloc(hits->arr, hits->capacity * sizeof(SwimdQueryHit));
+    }
+    hits->length = length;
+    for (int i = 0; i < length; i++) {
+        SwimdScoresHeapItem heap_item = scanner->scores_heap.arr[length - i - 1];
+        hits->arr[i] = (SwimdQueryHit){
+            .index = heap_item.index,
+            .score = heap_item.score
+        };
+    }
 
-    for (int i = 0; i < scanner->scores_heap.size; i++) {
-        SwimdScoresHeapItem heap_item = scanner->scores_heap.arr[i];
-        SwimdFile file = scanner->files->arr[heap_item.index];
+    swimd_top_scores_free(scanner);
+    swimd_setup_needle_free(scanner);
+}
 
-        char path[MAX_PATH_LENGTH];
-        swimd_print_path(path, &file);
-        swimd_print_relative(path, scanner->scan_path, scanner->base_path);
-        int path_length = strlen(path);
+// Prints rows [first, last) of the hits, the snapshot is the one they were
+// scored on. The buffers of the result are grown as needed and reused.
+static void swimd_hits_print(SwimdSnapshot *snapshot,
+        SwimdQueryHits *hits,
+        int first,
+        int last,
+        SwimdProcessInputResult *result) {
+    first = MAX(first, 0);
+    last = MIN(last, hits->length);
+    int count = MAX(last - first, 0);
+    result->scan_in_progress = hits->scan_in_progress;
+    result->scanned_items_count = hits->scanned_items_count;
+    if (MAX(count, 1) > result->items_capacity) {
+        result->items_capacity = MAX(count, 1);
+        result->items = realloc(result->items, result->items_capacity * sizeof(SwimdProcessInputResultItem));
+        result->paths = realloc(result->paths, result->items_capacity * MAX_PATH_LENGTH);
+    }
+    result->items_length = 0;
+    result->paths_length = 0;
+
+    for (int i = first; i < last; i++) {
+        SwimdQueryHit hit = hits->arr[i];
+        SwimdFile *file = &snapshot->files->arr[hit.index];
+
+        SwimdFolderStruct *folder = swimd_folder_prefix(snapshot, file->folder);
+        char *path = result->paths + result->paths_length;
+        memcpy(path, folder->path, folder->path_length);
+        int name_length = MIN(file->name_length, MAX_PATH_LENGTH - 1 - folder->path_length);
+        memcpy(path + folder->path_length, file->name, name_length);
+        int path_length = folder->path_length + name_length;
+        path[path_length] = '\0';
+        result->paths_length += path_length + 1;
 
         SwimdProcessInputResultItem item = {0};
-        item.path = malloc((path_length + 1) * sizeof(char));
-        strcpy(item.path, path);
-        item.name = malloc((file.name_length + 1) * sizeof(char));
-        strcpy(item.name, file.name);
-        item.score = heap_item.score;
+        item.path = path;
+        item.name = path + folder->path_length;
+        item.score = hit.score;
 
         result->items[result->items_length] = item;
         result->items_length++;
     }
+}
 
-    for (int i = 0; i < result->items_length / 2; i++) {
-        SWAP(result->items[i], result->items[result->items_length - i - 1],
-                SwimdProcessInputResultItem);
+static void swimd_scan_check_overflow(SwimdScanner *scanner) {
+    if (scanner->watch_overflowed && !scanner->scan_in_progress) {
+        scanner->watch_overflowed = false;
+        swimd_scan_refresh_path(scanner);
     }
+}
 
-    swimd_top_scores_free(scanner);
-    swimd_setup_needle_free(scanner);
+// With a result every row is printed under the same lock, otherwise only the
+// hits are kept.
+static void swimd_scan_query(const char *input,
+        int max_size,
+        SwimdQueryHits *hits,
+        SwimdProcessInputResult *result,
+        SwimdScanner *scanner,
+        long query_id) {
+    // a refresh publishes its snapshot without the lock, so it never waits here
+    SwimdSnapshot *snapshot = swimd_snapshot_lock(scanner, swimd_snapshot_acquire(scanner));
+
+    hits->scanner = scanner;
+    hits->scanned_items_count = scanner->scan_files_count;
+    hits->length = 0;
+
+    if (snapshot == NULL) {
+        hits->scan_in_progress = scanner->scan_in_progress;
+    } else {
+        // the initial scan still runs, items only cover the files read so far
+        // or come from the index of the previous one
+        hits->scan_in_progress = snapshot->partial || snapshot->cached;
+        hits->generation = snapshot->generation;
+        swimd_process_input(input, max_size, hits, scanner, snapshot, query_id);
+    }
+    if (result != NULL)
+        swimd_hits_print(snapshot, hits, 0, hits->length, result);
+
+    swimd_crit_unlock(&scanner->scan_state_lock);
+    swimd_snapshot_release(snapshot);
 }
 
 static void swimd_scan_process_input(const char *input,
         int max_size,
         SwimdProcessInputResult *result,
         SwimdScanner *scanner) {
+    swimd_scan_check_overflow(scanner);
+    SwimdQueryHits hits = {0};
+    swimd_scan_query(input, max_size, &hits, result, scanner, 0);
+    swimd_query_hits_free(&hits);
+}
+
+// Prints rows [first, last) of hits kept from an earlier query. false when
+// the snapshot changed since, the query has to be submitted again.
+static bool swimd_query_hits_print(SwimdQueryHits *hits,
+        int first,
+        int last,
+        SwimdProcessInputResult *result) {
+    if (hits->length == 0) {
+        swimd_hits_print(NULL, hits, 0, 0, result);
+        return true;
+    }
+    SwimdScanner *scanner = hits->scanner;
+    SwimdSnapshot *snapshot = swimd_snapshot_lock(scanner, swimd_snapshot_acquire(scanner));
 
-    swimd_crit_lock(&scanner->scan_state_swap);
+    bool valid = snapshot != NULL && snapshot->generation == hits->generation;
+    if (valid)
+        swimd_hits_print(snapshot, hits, first, last, result);
 
-    result->scanned_items_count = scanner->scan_files_count;
+    swimd_crit_unlock(&scanner->scan_state_lock);
+    swimd_snapshot_release(snapshot);
+    return valid;
+}
 
-    if (scanner->scan_in_progress && !scanner->scan_is_refreshing) {
-        result->scan_in_progress = true;
-    } else {
-        result->scan_in_progress = false;
-        swimd_process_input(input, max_size, result, scanner);
-    }
+static void swimd_query_worker_impl(void) {
+    SwimdQueryQueue *queue = &swimd_query_queue;
+    while (1) {
+        swimd_are_wait(&queue->work_begin);
+
+        if (queue->terminate)
+            break;
+
+        swimd_crit_lock(&queue->lock);
+        SwimdQueryRequest request = queue->pending;
+        queue->pending.needle = NULL;
+        swimd_crit_unlock(&queue->lock);
+        if (request.needle == NULL)
+            continue;
 
-    swimd_crit_unlock(&scanner->scan_state_swap);
+        SwimdQueryHits hits = {0};
+        swimd_scan_query(request.needle,
+                request.max_size,
+                &hits,
+                NULL,
+                &swimd_scanners[request.scanner_index],
+                request.id);
+
+        swimd_crit_lock(&queue->lock);
+        bool latest = request.id == queue->submitted_id;
+        if (latest) {
+            swimd_query_hits_free(&queue->result);
+            queue->result = hits;
+            queue->done_id = request.id;
+            queue->done_polled = false;
+        } else {
+            swimd_query_hits_free(&hits);
+        }
+        swimd_crit_unlock(&queue->lock);
+        if (latest)
+            swimd_notify(SWIMD_NOTIFY_QUERY);
+        free(request.needle);
+    }
 }
 
-static void swimd_scan_process_input_free(SwimdProcessInputResult *result) {
-    if (result->items == NULL)
-        return;
+#ifdef _WIN32
+static DWORD WINAPI swimd_query_worker_loop(LPVOID lp_param) {
+    swimd_query_worker_impl();
+    return 0;
+}
+#else
+static void* swimd_query_worker_loop(void *lp_param) {
+    swimd_query_worker_impl();
+    return NULL;
+}
+#endif
 
-    for (int i = 0; i < result->items_length; i++) {
-        SwimdProcessInputResultItem item = result->items[i];
-        free(item.path);
-        free(item.name);
+static void swimd_query_queue_init(void) {
+    SwimdQueryQueue *queue = &swimd_query_queue;
+    memset(queue, 0, sizeof(SwimdQueryQueue));
+    swimd_crit_init(&queue->lock);
+    swimd_are_init(&queue->work_begin, false);
+    swimd_thread_create(&queue->thread, &swimd_query_worker_loop, NULL);
+}
+
+static void swimd_query_queue_free(void) {
+    SwimdQueryQueue *queue = &swimd_query_queue;
+    queue->terminate = true;
+    queue->submitted_id++; // aborts the scoring in flight
+    swimd_are_set(&queue->work_begin);
+    swimd_thread_join(&queue->thread);
+    swimd_thread_close(&queue->thread);
+    swimd_are_close(&queue->work_begin);
+    swimd_crit_close(&queue->lock);
+    free(queue->pending.needle);
+    swimd_query_hits_free(&queue->result);
+    memset(queue, 0, sizeof(SwimdQueryQueue));
+}
+
+// Returns the id to poll for, a request still pending is dropped. -1 when the
+// library is not initialized or there is no such scanner, no query gets it.
+static long swimd_query_submit(const char *needle, int max_size, int scanner_index) {
+    if (!swimd_initialized || scanner_index < 0 || scanner_index >= SCANNER_COUNT)
+        return -1;
+    SwimdQueryQueue *queue = &swimd_query_queue;
+    swimd_scan_check_overflow(&swimd_scanners[scanner_index]);
+
+    swimd_crit_lock(&queue->lock);
+    free(queue->pending.needle);
+    long id = queue->submitted_id + 1;
+    queue->pending = (SwimdQueryRequest){
+        .needle = strcpy(malloc(strlen(needle) + 1), needle),
+        .max_size = max_size,
+        .scanner_index = scanner_index,
+        .id = id,
+    };
+    queue->submitted_id = id;
+    swimd_crit_unlock(&queue->lock);
+
+    swimd_are_set(&queue->work_begin);
+    return id;
+}
+
+// 1 and the hits are moved out, 0 while the query still runs, -1 once a
+// newer query replaced it, its hits were already taken or it was never
+// submitted.
+static int swimd_query_poll(long id, SwimdQueryHits *hits) {
+    if (!swimd_initialized || id < 0)
+        return -1;
+    SwimdQueryQueue *queue = &swimd_query_queue;
+    int status = 0;
+    swimd_crit_lock(&queue->lock);
+    if (id == queue->done_id && !queue->done_polled) {
+        *hits = queue->result;
+        queue->result = (SwimdQueryHits){0};
+        queue->done_polled = true;
+        status = 1;
+    } else if (id == queue->done_id || id != queue->submitted_id) {
+        status = -1;
     }
-    free(result->items);
+    swimd_crit_unlock(&queue->lock);
+    return status;
+}
+
+// Rows whose path doesn't fit in the caller's buffer are dropped.
+static void swimd_ffi_result_fill(SwimdFfiResult *out, SwimdProcessInputResult *result) {
+    out->scan_in_progress = result->scan_in_progress;
+    out->scanned_items_count = result->scanned_items_count;
+    int paths_length = 0;
+    int items_length = 0;
+    for (; items_length < result->items_length; items_length++) {
+        SwimdProcessInputResultItem *item = &result->items[items_length];
+        int path_offset = item->path - result->paths;
+        int path_end = path_offset + strlen(item->path) + 1;
+        if (path_end > out->paths_size)
+            break;
+        out->items[items_length] = (SwimdFfiItem){
+            .score = item->score,
+            .path_offset = path_offset,
+            .name_offset = item->name - result->paths,
+        };
+        paths_length = path_end;
+    }
+    out->items_length = items_length;
+    if (paths_length > 0)
+        memcpy(out->paths, result->paths, paths_length);
+}
+
+// LuaJIT FFI counterpart of process_input, returns the items count or -1 when
+// the library is not initialized or there is no such scanner. Hits and rows go
+// through the buffers of the scanner, a call doesn't allocate once they fit.
+EXPORT
+int swimd_query_ffi(const char *needle, int max_size, int scanner_index, SwimdFfiResult *out) {
+    if (!swimd_initialized || scanner_index < 0 || scanner_index >= SCANNER_COUNT)
+        return -1;
+    SwimdScanner *scanner = &swimd_scanners[scanner_index];
+    swimd_scan_check_overflow(scanner);
+    swimd_scan_query(needle, max_size, &scanner->ffi_hits, &scanner->ffi_result, scanner, 0);
+    swimd_ffi_result_fill(out, &scanner->ffi_result);
+    return out->items_length;
+}
+
+// LuaJIT FFI counterpart of the rows method of a poll_query handle, the
+// handle converts to a pointer to its hits. Rows start at 0, returns the
+// count filled or -1 when the snapshot changed since the query.
+EXPORT
+int swimd_rows_ffi(const void *handle, int first, int count, SwimdFfiResult *out) {
+    SwimdQueryHits *hits = (SwimdQueryHits*)handle;
+    if (!swimd_initialized || hits->scanner == NULL)
+        return -1;
+    SwimdProcessInputResult *result = &hits->scanner->ffi_result;
+    bool valid = swimd_query_hits_print(hits, first, first + count, result);
+    if (valid)
+        swimd_ffi_result_fill(out, result);
+    return valid ? out->items_length : -1;
 }
 
 static int swimd_lua_init(lua_State *L) {
@@ -1887,6 +5938,7 @@ static int swimd_lua_init(lua_State *L) {
     for (int i = 0; i < SCANNER_COUNT; i++) {
         swimd_scan_glob_init(&swimd_scanners[i]);
     }
+    swimd_query_queue_init();
 
     swimd_log_append(SWIMD_INFO, "Initializing completed");
     return 0;
@@ -1898,6 +5950,7 @@ static int swimd_lua_shutdown(lua_State *L) {
     }
     swimd_log_append(SWIMD_INFO, "Shutting down");
 
+    swimd_query_queue_free();
     for (int i = 0; i < SCANNER_COUNT; i++) {
         swimd_scan_glob_free(&swimd_scanners[i]);
     }
@@ -1971,15 +6024,31 @@ static int swimd_lua_is_refreshing(lua_State *L) {
     return 1;
 }
 
-static int swimd_lua_process_input(lua_State *L) {
-    const char *input = luaL_checkstring(L, 1);
-    int max_size = luaL_checknumber(L, 2);
-    int scanner_index = luaL_checknumber(L, 3);
+static void swimd_lua_push_items(lua_State *L, SwimdProcessInputResult result) {
+    lua_newtable(L);
+    for (int i = 0; i < result.items_length; i++) {
+        SwimdProcessInputResultItem item = result.items[i];
 
-    SwimdProcessInputResult result = {0};
-    SwimdScanner *scanner = &swimd_scanners[scanner_index];
+        lua_pushnumber(L, i + 1);
 
-    swimd_scan_process_input(input, max_size, &result, scanner);
+        lua_newtable(L);
+        lua_pushstring(L, "name");
+        lua_pushstring(L, item.name);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "score");
+        lua_pushinteger(L, item.score);
+        lua_settable(L, -3);
+
+        lua_pushstring(L, "path");
+        lua_pushstring(L, item.path);
+        lua_settable(L, -3);
+
+        lua_settable(L, -3);
+    }
+}
+
+static void swimd_lua_push_result(lua_State *L, SwimdProcessInputResult result) {
     lua_newtable(L);
     lua_pushstring(L, "scan_in_progress");
     lua_pushboolean(L, result.scan_in_progress);
@@ -1990,35 +6059,197 @@ static int swimd_lua_process_input(lua_State *L) {
     lua_settable(L, -3);
 
     lua_pushstring(L, "items");
-    lua_newtable(L);
-    if (!result.scan_in_progress) {
-        for (int i = 0; i < result.items_length; i++) {
-            SwimdProcessInputResultItem item = result.items[i];
+    swimd_lua_push_items(L, result);
+    lua_settable(L, -3);
+}
+
+static int swimd_lua_process_input(lua_State *L) {
+    const char *input = luaL_checkstring(L, 1);
+    int max_size = luaL_checknumber(L, 2);
+    int scanner_index = luaL_checknumber(L, 3);
+
+    SwimdProcessInputResult result = {0};
+    SwimdScanner *scanner = &swimd_scanners[scanner_index];
+
+    swimd_scan_process_input(input, max_size, &result, scanner);
+    swimd_lua_push_result(L, result);
 
-            lua_pushnumber(L, i + 1);
+    swimd_scan_process_input_free(&result);
+    return 1;
+}
 
-            lua_newtable(L);
-            lua_pushstring(L, "name");
-            lua_pushstring(L, item.name);
-            lua_settable(L, -3);
+// Same arguments as process_input, returns an id for poll_query. A query that
+// can't run gets -1, which poll_query reports as replaced.
+static int swimd_lua_submit_query(lua_State *L) {
+    const char *input = luaL_checkstring(L, 1);
+    int max_size = luaL_checknumber(L, 2);
+    int scanner_index = luaL_checknumber(L, 3);
 
-            lua_pushstring(L, "score");
-            lua_pushinteger(L, item.score);
-            lua_settable(L, -3);
+    lua_pushinteger(L, swimd_query_submit(input, max_size, scanner_index));
+    return 1;
+}
 
-            lua_pushstring(L, "path");
-            lua_pushstring(L, item.path);
-            lua_settable(L, -3);
+// A handle to the rows once the query is done, nil while it runs, false when
+// a newer query replaced it. Paths are only printed by handle:rows.
+static int swimd_lua_poll_query(lua_State *L) {
+    long id = luaL_checkinteger(L, 1);
 
-            lua_settable(L, -3);
-        }
+    SwimdQueryHits hits = {0};
+    int status = swimd_query_poll(id, &hits);
+    if (status == 0) {
+        lua_pushnil(L);
+    } else if (status < 0) {
+        lua_pushboolean(L, false);
+    } else {
+        SwimdQueryHits *handle = lua_newuserdata(L, sizeof(SwimdQueryHits));
+        *handle = hits;
+        luaL_getmetatable(L, SWIMD_HITS_METATABLE);
+        lua_setmetatable(L, -2);
     }
-    lua_settable(L, -3);
+    return 1;
+}
+
+static int swimd_lua_hits_gc(lua_State *L) {
+    SwimdQueryHits *hits = luaL_checkudata(L, 1, SWIMD_HITS_METATABLE);
+    swimd_query_hits_free(hits);
+    return 0;
+}
+
+static int swimd_lua_hits_count(lua_State *L) {
+    SwimdQueryHits *hits = luaL_checkudata(L, 1, SWIMD_HITS_METATABLE);
+    lua_pushinteger(L, hits->length);
+    return 1;
+}
+
+static int swimd_lua_hits_scan_in_progress(lua_State *L) {
+    SwimdQueryHits *hits = luaL_checkudata(L, 1, SWIMD_HITS_METATABLE);
+    lua_pushboolean(L, hits->scan_in_progress);
+    return 1;
+}
+
+static int swimd_lua_hits_scanned_items_count(lua_State *L) {
+    SwimdQueryHits *hits = luaL_checkudata(L, 1, SWIMD_HITS_METATABLE);
+    lua_pushinteger(L, hits->scanned_items_count);
+    return 1;
+}
 
+// Items first to last, 1 based and inclusive, like the items of
+// process_input. nil when the snapshot changed since the query.
+static int swimd_lua_hits_rows(lua_State *L) {
+    SwimdQueryHits *hits = luaL_checkudata(L, 1, SWIMD_HITS_METATABLE);
+    int first = luaL_checkinteger(L, 2);
+    int last = luaL_optinteger(L, 3, first);
+
+    SwimdProcessInputResult result = {0};
+    if (swimd_initialized && swimd_query_hits_print(hits, first - 1, last, &result)) {
+        swimd_lua_push_items(L, result);
+    } else {
+        lua_pushnil(L);
+    }
     swimd_scan_process_input_free(&result);
     return 1;
 }
 
+// File descriptor for a libuv poll handle, readable once a scan finished, a
+// scan grew its partial results or an asynchronous query is done. nil where
+// there is none and the editor has to poll.
+static int swimd_lua_notify_fd(lua_State *L) {
+    if (swimd_notify_fd < 0) {
+        lua_pushnil(L);
+    } else {
+        lua_pushinteger(L, swimd_notify_fd);
+    }
+    return 1;
+}
+
+// Mask of swimd.NOTIFY_QUERY and swimd.NOTIFY_SCAN since the last call.
+static int swimd_lua_notify_drain(lua_State *L) {
+    lua_pushinteger(L, swimd_notify_drain());
+    return 1;
+}
+
+// Takes effect on the next scan or refresh of the files scanner.
+static int swimd_lua_set_prune_list(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (!swimd_initialized) {
+        swimd_log_append(SWIMD_WARN, "Prune list set before init, ignored");
+        return 0;
+    }
+    int length = lua_objlen(L, 1);
+    // checked before anything is allocated, a Lua error would leak it
+    for (int i = 0; i < length; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 1, "patterns must be strings");
+        lua_pop(L, 1);
+    }
+    char **list = malloc(MAX(length, 1) * sizeof(char*));
+    for (int i = 0; i < length; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        const char *pattern = lua_tostring(L, -1);
+        list[i] = malloc(strlen(pattern) + 1);
+        strcpy(list[i], pattern);
+        lua_pop(L, 1);
+    }
+
+    SwimdScanner *scanner = &swimd_scanners[SCANNER_FILES];
+    swimd_crit_lock(&scanner->scan_state_lock);
+    swimd_prune_list_free();
+    swimd_prune_list = list;
+    swimd_prune_list_length = length;
+    swimd_crit_unlock(&scanner->scan_state_lock);
+
+    swimd_log_append(SWIMD_INFO, "Prune list set with %d patterns", length);
+    return 0;
+}
+
+// Takes effect on the next scan or refresh of the files scanner, Linux only.
+static int swimd_lua_set_watch(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TBOOLEAN);
+#ifdef _WIN32
+    swimd_log_append(SWIMD_WARN, "Watch mode is not supported on this platform");
+#else
+    swimd_watch_enabled = lua_toboolean(L, 1);
+    swimd_log_append(SWIMD_INFO, "Watch mode %s", swimd_watch_enabled ? "enabled" : "disabled");
+#endif
+    return 0;
+}
+
+// Directory for the index of each scan, nil turns it off. Takes effect on the
+// next setup of the workspace.
+static int swimd_lua_set_index_dir(lua_State *L) {
+    const char *dir = lua_isnoneornil(L, 1) ? NULL : luaL_checkstring(L, 1);
+    if (!swimd_initialized) {
+        swimd_log_append(SWIMD_WARN, "Index dir set before init, ignored");
+        return 0;
+    }
+    char *index_dir = NULL;
+    if (dir != NULL) {
+        index_dir = malloc((strlen(dir) + 1) * sizeof(char));
+        strcpy(index_dir, dir);
+    }
+
+    for (int i = 0; i < SCANNER_COUNT; i++) {
+        swimd_crit_lock(&swimd_scanners[i].scan_state_lock);
+    }
+    free(swimd_index_dir);
+    swimd_index_dir = index_dir;
+    for (int i = SCANNER_COUNT - 1; i >= 0; i--) {
+        swimd_crit_unlock(&swimd_scanners[i].scan_state_lock);
+    }
+
+    swimd_log_append(SWIMD_INFO, "Index dir set to %s", dir != NULL ? dir : "none");
+    return 0;
+}
+
+static int swimd_lua_kernel(lua_State *L) {
+    if (!swimd_initialized) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushstring(L, swimd_kernel.name);
+    return 1;
+}
+
 static int swimd_lua_sayhello(lua_State *L) {
     const char *str = luaL_checkstring(L, 1);
     char greeting[100] = "Hello, ";
@@ -2034,6 +6265,23 @@ static int swimd_lua_log(lua_State *L) {
     return 1;
 }
 
+static void swimd_lua_hits_register(lua_State *L) {
+    static const luaL_Reg methods[] = {
+        {"count", swimd_lua_hits_count},
+        {"scan_in_progress", swimd_lua_hits_scan_in_progress},
+        {"scanned_items_count", swimd_lua_hits_scanned_items_count},
+        {"rows", swimd_lua_hits_rows},
+        {NULL, NULL}
+    };
+    luaL_newmetatable(L, SWIMD_HITS_METATABLE);
+    lua_newtable(L);
+    luaL_register(L, NULL, methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, swimd_lua_hits_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+}
+
 EXPORT
 int luaopen_swimd(lua_State *L) {
     static const luaL_Reg funcs[] = {
@@ -2042,12 +6290,21 @@ int luaopen_swimd(lua_State *L) {
         {"refresh_workspace", swimd_lua_refresh_workspace},
         {"is_refreshing", swimd_lua_is_refreshing},
         {"process_input", swimd_lua_process_input},
+        {"submit_query", swimd_lua_submit_query},
+        {"poll_query", swimd_lua_poll_query},
+        {"notify_fd", swimd_lua_notify_fd},
+        {"notify_drain", swimd_lua_notify_drain},
         {"shutdown", swimd_lua_shutdown},
+        {"kernel", swimd_lua_kernel},
+        {"set_prune_list", swimd_lua_set_prune_list},
+        {"set_watch", swimd_lua_set_watch},
+        {"set_index_dir", swimd_lua_set_index_dir},
         {"say_hello", swimd_lua_sayhello},
         {"log", swimd_lua_log},
 
         {NULL, NULL}
     };
+    swimd_lua_hits_register(L);
     luaL_register(L, "swimd", funcs);
 
     lua_pushinteger(L, SCANNER_FILES);
@@ -2056,6 +6313,15 @@ int luaopen_swimd(lua_State *L) {
     lua_pushinteger(L, SCANNER_GIT);
     lua_setfield(L, -2, "SCANNER_GIT");
 
+    lua_pushinteger(L, SWIMD_NOTIFY_QUERY);
+    lua_setfield(L, -2, "NOTIFY_QUERY");
+
+    lua_pushinteger(L, SWIMD_NOTIFY_SCAN);
+    lua_setfield(L, -2, "NOTIFY_SCAN");
+
+    lua_pushinteger(L, MAX_PATH_LENGTH);
+    lua_setfield(L, -2, "MAX_PATH_LENGTH");
+
     return 1;
 }
 